@@ -1,15 +1,25 @@
 #include <algorithm>
+#include <atomic>
 #include <cstdlib>
+#include <cstdio>
+#include <deque>
+#include <stdint.h>
 #include <iostream>
 #include <cmath>
 #include <map>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
 #include <cassert>
 #include <float.h>
 #include <string.h>
 #include <queue>
 #include <limits.h>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 using namespace std;
@@ -20,18 +30,60 @@ const int SPACE_SIZE = 1024;
 const int MAX_STAR = 2000;
 const int MAX_SHIP = 10;
 const int MAX_UFO = 20;
+const int NEAR_SIZE = 8;
+const int MAX_GALAXY = 16;
+// mean distance from the center of a gaussian galaxy (sigma 100) is about 125
+const double GALAXY_RADIUS = 150.0;
+// a space filling curve tour is about 25% longer than an optimal tour
+const double HILBERT_RATIO = 0.75;
+// turns the estimate must prefer the endgame before switching to TSP mode
+const int SWITCH_STREAK = 200;
+// a star beyond the turns left of its ship costs about a crossing of the space
+const double OVERFLOW_COST = SPACE_SIZE;
 const ll CYCLE_PER_SEC = 2400000000;
-double MAX_TIME = 20.0;
-double FIRST_TIME_LIMIT = 1.0;
+const double MAX_TIME = 20.0;
+const double FIRST_TIME_LIMIT = 1.0;
+
+inline unsigned long long splitMix64(unsigned long long &x) {
+  unsigned long long z = (x += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
 
-double DIST_TABLE[MAX_STAR][MAX_STAR];
+// xorshift generator, each worker owns one stream derived from (seed, stream)
+struct XorShift {
+  unsigned long long rx, ry, rz, rw;
 
-unsigned long long xor128(){
-  static unsigned long long rx=123456789, ry=362436069, rz=521288629, rw=88675123;
-  unsigned long long rt = (rx ^ (rx<<11));
-  rx=ry; ry=rz; rz=rw;
-  return (rw=(rw^(rw>>19))^(rt^(rt>>8)));
-}
+  XorShift (unsigned long long seed = 0, unsigned long long stream = 0) {
+    setSeed(seed, stream);
+  }
+
+  void setSeed(unsigned long long seed, unsigned long long stream) {
+    unsigned long long x = seed ^ (stream * 0xD1B54A32D192ED03ULL);
+
+    this->rx = splitMix64(x);
+    this->ry = splitMix64(x);
+    this->rz = splitMix64(x);
+    this->rw = splitMix64(x) | 1;
+  }
+
+  unsigned long long next() {
+    unsigned long long rt = (rx ^ (rx<<11));
+    rx=ry; ry=rz; rz=rw;
+    return (rw=(rw^(rw>>19))^(rt^(rt>>8)));
+  }
+
+  // uniform in [0, n) by multiply-shift, no division
+  inline int nextInt(int n) {
+    return (int)(((next() >> 32) * (unsigned long long)n) >> 32);
+  }
+
+  // uniform in [0, 1)
+  inline double nextDouble() {
+    return (next() >> 11) * (1.0 / 9007199254740992.0);
+  }
+};
 
 unsigned long long int getCycle() {
   unsigned int low, high;
@@ -47,28 +99,198 @@ inline double calcDist(int y1, int x1, int y2, int x2) {
   return sqrt((y2-y1)*(y2-y1) + (x2-x1)*(x2-x1));
 }
 
-struct Star {
-  int y;
-  int x;
-  bool visited;
+/*
+ * hungarian method for a rows x cols cost matrix (rows <= cols).
+ * returns the column assigned to every row, O(rows^2 * cols).
+ */
+vector<int> solveAssignment(const vector< vector<double> > &cost) {
+  int n = cost.size();
+  int m = (n == 0)? 0 : cost[0].size();
+  vector<double> u(n+1, 0.0), v(m+1, 0.0);
+  vector<int> p(m+1, 0), way(m+1, 0);
+
+  for (int i = 1; i <= n; i++) {
+    p[0] = i;
+    int j0 = 0;
+    vector<double> minv(m+1, DBL_MAX);
+    vector<bool> used(m+1, false);
+
+    do {
+      used[j0] = true;
+      int i0 = p[j0];
+      int j1 = 0;
+      double delta = DBL_MAX;
+
+      for (int j = 1; j <= m; j++) {
+        if (used[j]) continue;
+        double cur = cost[i0-1][j-1] - u[i0] - v[j];
+
+        if (cur < minv[j]) {
+          minv[j] = cur;
+          way[j] = j0;
+        }
+        if (minv[j] < delta) {
+          delta = minv[j];
+          j1 = j;
+        }
+      }
+
+      for (int j = 0; j <= m; j++) {
+        if (used[j]) {
+          u[p[j]] += delta;
+          v[j] -= delta;
+        } else {
+          minv[j] -= delta;
+        }
+      }
+
+      j0 = j1;
+    } while (p[j0] != 0);
 
-  Star (int y = -1, int x = -1) {
-    this->y = y;
-    this->x = x;
-    this->visited = false;
+    do {
+      int j1 = way[j0];
+      p[j0] = p[j1];
+      j0 = j1;
+    } while (j0 != 0);
+  }
+
+  vector<int> result(n, -1);
+  for (int j = 1; j <= m; j++) {
+    if (p[j] > 0) {
+      result[p[j]-1] = j-1;
+    }
+  }
+
+  return result;
+}
+
+inline int hilbertOrder(int y, int x) {
+  int d = 0;
+
+  for (int s = SPACE_SIZE/2; s > 0; s /= 2) {
+    int ry = (y & s) > 0;
+    int rx = (x & s) > 0;
+    d += s * s * ((3 * rx) ^ ry);
+
+    if (ry == 0) {
+      if (rx == 1) {
+        y = s-1 - y;
+        x = s-1 - x;
+      }
+      int t = y;
+      y = x;
+      x = t;
+    }
+  }
+
+  return d;
+}
+
+/*
+ * hand tuned constants. a file named by STAR_PARAMS may override them with
+ * "key = value" lines, scripts/tune.rb writes such files per instance class.
+ */
+struct Params {
+  double rideLineSolo;
+  double rideLineEarly;
+  double rideLineEarlyMany;
+  double rideLineFull;
+  double rideLineFullMany;
+  double rideLineLate;
+  double aroundStarDist;
+  double aroundShipDist;
+  double transferDist;
+  double firstSolveTime;
+  double solveRatio;
+  double retrySingle;
+  double retryMulti;
+  double gapThreshold;
+  double coverPrior;
+  double coverLimit;
+  double coverValue;
+  double switchShips;
+
+  Params () {
+    this->rideLineSolo = 756;
+    this->rideLineEarly = 64;
+    this->rideLineEarlyMany = 32;
+    this->rideLineFull = 16;
+    this->rideLineFullMany = 0;
+    this->rideLineLate = 256;
+    this->aroundStarDist = 40.0;
+    this->aroundShipDist = 120.0;
+    this->transferDist = 10.0;
+    this->firstSolveTime = 2.5;
+    this->solveRatio = 0.9;
+    this->retrySingle = 10;
+    this->retryMulti = 20;
+    this->gapThreshold = 0.005;
+    this->coverPrior = 100.0;
+    this->coverLimit = 1.0;
+    this->coverValue = 2.0;
+    this->switchShips = 1.0;
+  }
+
+  double *find(const char *name) {
+    struct { const char *name; double *value; } table[] = {
+      {"rideLineSolo", &rideLineSolo},
+      {"rideLineEarly", &rideLineEarly},
+      {"rideLineEarlyMany", &rideLineEarlyMany},
+      {"rideLineFull", &rideLineFull},
+      {"rideLineFullMany", &rideLineFullMany},
+      {"rideLineLate", &rideLineLate},
+      {"aroundStarDist", &aroundStarDist},
+      {"aroundShipDist", &aroundShipDist},
+      {"transferDist", &transferDist},
+      {"firstSolveTime", &firstSolveTime},
+      {"solveRatio", &solveRatio},
+      {"retrySingle", &retrySingle},
+      {"retryMulti", &retryMulti},
+      {"gapThreshold", &gapThreshold},
+      {"coverPrior", &coverPrior},
+      {"coverLimit", &coverLimit},
+      {"coverValue", &coverValue},
+      {"switchShips", &switchShips},
+    };
+    int size = sizeof(table) / sizeof(table[0]);
+
+    for (int i = 0; i < size; i++) {
+      if (strcmp(table[i].name, name) == 0) {
+        return table[i].value;
+      }
+    }
+
+    return NULL;
   }
 };
 
+// what a ship decided to do this turn, energy is accounted per ship and move type
+enum MoveType {
+  MOVE_BOARD,
+  MOVE_RIDEOFF,
+  MOVE_TRANSFER,
+  MOVE_RIDE,
+  MOVE_STAY,
+  MOVE_ENDGAME,
+  MOVE_TYPE_COUNT
+};
+
+const char *MOVE_TYPE_NAME[MOVE_TYPE_COUNT] = {
+  "boarding", "rideoff", "transfer", "ride", "stationary", "endgame"
+};
+
 struct Ship {
   int sid;
   int nid;
   int uid;
+  MoveType move;
   vector<int> path;
 
   Ship () {
     this->sid = -1;
     this->nid = -1;
     this->uid = -1;
+    this->move = MOVE_STAY;
   }
 };
 
@@ -95,97 +317,1316 @@ struct UFO {
   }
 };
 
-vector<Star> g_starList;
-Ship g_shipList[MAX_SHIP];
-UFO g_ufoList[MAX_UFO];
-vector<int> g_path;
-int g_psize;
-
-int g_turn;
-int g_starCount;
-int g_shipCount;
-int g_ufoCount;
-int g_timeLimit;
-int g_remainCount;
-int g_rideLine;
-int g_crewCount;
-double g_currentCost;
-bool g_TSPMode;
-bool g_checkFlag;
-bool g_warning;
-double g_totalTime;
-double g_remainTime;
+/*
+ * all ship routes of the multi ship endgame in one buffer, route r is
+ * tour[start[r]] .. tour[start[r+1]-1]. it is plain data, so a snapshot is a
+ * memcpy and moving stars between routes only shifts them inside the buffer.
+ */
+template <class Index>
+struct GiantTourT {
+  int routeCount;
+  int start[MAX_SHIP+1];
+  Index tour[MAX_STAR];
+
+  GiantTourT () {
+    this->routeCount = 0;
+    this->start[0] = 0;
+  }
+
+  int size(int r) {
+    return start[r+1] - start[r];
+  }
+
+  int total() {
+    return start[routeCount];
+  }
+
+  void assign(vector< vector<int> > &paths) {
+    routeCount = paths.size();
+    start[0] = 0;
+
+    for (int r = 0; r < routeCount; r++) {
+      int size = paths[r].size();
+
+      for (int i = 0; i < size; i++) {
+        tour[start[r] + i] = paths[r][i];
+      }
+      start[r+1] = start[r] + size;
+    }
+  }
+
+  void copyFrom(GiantTourT &src) {
+    routeCount = src.routeCount;
+    memcpy(start, src.start, (routeCount+1) * sizeof(int));
+    memcpy(tour, src.tour, src.total() * sizeof(Index));
+  }
+
+  // copies the routes r1 .. r2 back from src, the other routes must be equal
+  void copyRoutes(GiantTourT &src, int r1, int r2) {
+    if (r1 > r2) swap(r1, r2);
+
+    memcpy(start + r1+1, src.start + r1+1, (r2-r1) * sizeof(int));
+    memcpy(tour + start[r1], src.tour + start[r1], (start[r2+1] - start[r1]) * sizeof(Index));
+  }
+
+  /*
+   * exchanges the block [a, b) of route r1 with the block [c, d) of route r2,
+   * b <= c. an empty block moves the other one to its place.
+   */
+  void swapBlocks(int r1, int a, int b, int r2, int c, int d) {
+    int len1 = b - a;
+    int len2 = d - c;
+
+    reverse(tour+a, tour+d);
+    reverse(tour+a, tour+a+len2);
+    reverse(tour+a+len2, tour+d-len1);
+    reverse(tour+d-len1, tour+d);
+
+    for (int r = r1+1; r <= r2; r++) {
+      start[r] += len2 - len1;
+    }
+  }
+
+  // moves the block [a, b) of route r1 in front of position p of route r2
+  void moveBlock(int r1, int a, int b, int r2, int p) {
+    if (p <= a) {
+      swapBlocks(r2, p, p, r1, a, b);
+    } else {
+      swapBlocks(r1, a, b, r2, p, p);
+    }
+  }
+};
+
+// star ids fit in 16 bits, which halves the bytes moved by scans and snapshots
+typedef uint16_t StarIndex;
+typedef GiantTourT<StarIndex> GiantTour;
+static_assert(MAX_STAR <= 65536, "star ids must fit in StarIndex");
+static_assert(MAX_SHIP <= 256, "ship ids must fit in a byte");
+
+const int LOG_TABLE_SIZE = 4096;
+const double CALIBRATE_QUANTILE = 0.01;
+const double CALIBRATE_ACCEPT = 0.1;
+
+enum CoolingSchedule {
+  COOLING_LINEAR,
+  COOLING_EXPONENTIAL
+};
+
+/*
+ * simulated annealing driven by the elapsed fraction of a time budget.
+ * the temperature runs from startTemp down to startTemp * endRatio, restarting
+ * reheatCount times. a move is accepted when its delta is below a threshold
+ * T * -log(u) taken from a precomputed table, so no exp is evaluated per move.
+ */
+struct Annealer {
+  CoolingSchedule schedule;
+  int reheatCount;
+  double startTemp;
+  double endRatio;
+  double timeLimit;
+  double temp;
+  double progress;
+  ll startCycle;
+  double negLogTable[LOG_TABLE_SIZE];
+
+  Annealer (double timeLimit, CoolingSchedule schedule = COOLING_EXPONENTIAL, int reheatCount = 0) {
+    this->schedule = schedule;
+    this->reheatCount = reheatCount;
+    this->startTemp = 1.0;
+    this->endRatio = 0.001;
+    this->timeLimit = timeLimit;
+    this->temp = 1.0;
+    this->progress = 0.0;
+    this->startCycle = getCycle();
+
+    for (int i = 0; i < LOG_TABLE_SIZE; i++) {
+      negLogTable[i] = -log((i + 0.5) / LOG_TABLE_SIZE);
+    }
+  }
+
+  /*
+   * the worsening move at the given quantile of the sampled deltas is accepted
+   * with probability acceptRate at the start. random moves on a constructed tour
+   * are mostly far worse than the moves that matter, so a low quantile is used.
+   */
+  void calibrate(vector<double> &deltas, double quantile = CALIBRATE_QUANTILE, double acceptRate = CALIBRATE_ACCEPT) {
+    vector<double> worse;
+
+    for (int i = 0; i < (int)deltas.size(); i++) {
+      if (deltas[i] > 0.0) {
+        worse.push_back(deltas[i]);
+      }
+    }
+
+    if (worse.empty()) return;
+
+    sort(worse.begin(), worse.end());
+    startTemp = worse[(int)(quantile * (worse.size()-1))] / -log(acceptRate);
+    temp = startTemp;
+  }
+
+  // call every few moves, returns false once the budget is used up
+  bool update() {
+    double currentTime = getTime(startCycle);
+
+    if (currentTime > timeLimit) {
+      return false;
+    }
+
+    progress = currentTime / timeLimit;
+    double local = progress * (reheatCount + 1);
+    local -= floor(local);
+
+    switch (schedule) {
+      case COOLING_LINEAR:
+        temp = startTemp * (1.0 - local + endRatio * local);
+        break;
+      case COOLING_EXPONENTIAL:
+        temp = startTemp * pow(endRatio, local);
+        break;
+    }
+
+    return true;
+  }
+
+  double threshold(XorShift &rng) {
+    return temp * negLogTable[rng.next() & (LOG_TABLE_SIZE-1)];
+  }
+
+  bool accept(double delta, XorShift &rng) {
+    return delta <= 0.0 || delta < threshold(rng);
+  }
+};
+
+const int MAX_MOVE_TYPE = 11;
+// draws between two weight updates of a MoveSelector
+const int SELECT_WINDOW = 4096;
+// share of the draws that stays uniform, so a type that pays off again is noticed
+const double SELECT_FLOOR = 0.2;
+
+/*
+ * counters per move type of an annealer and a bandit that draws the types.
+ * every SELECT_WINDOW draws the weights follow the recent gain per cycle of
+ * each type, the older windows count half as much each time.
+ */
+struct MoveSelector {
+  int typeCount;
+  int draws;
+  ll proposed[MAX_MOVE_TYPE];
+  ll invalid[MAX_MOVE_TYPE];
+  ll accepted[MAX_MOVE_TYPE];
+  ll improving[MAX_MOVE_TYPE];
+  ll cycles[MAX_MOVE_TYPE];
+  double gain[MAX_MOVE_TYPE];
+  double recentGain[MAX_MOVE_TYPE];
+  double recentCycles[MAX_MOVE_TYPE];
+  double cumWeight[MAX_MOVE_TYPE];
+
+  MoveSelector (int typeCount = MAX_MOVE_TYPE) {
+    init(typeCount);
+  }
+
+  void init(int typeCount) {
+    this->typeCount = typeCount;
+    memset(proposed, 0, sizeof(proposed));
+    memset(invalid, 0, sizeof(invalid));
+    memset(accepted, 0, sizeof(accepted));
+    memset(improving, 0, sizeof(improving));
+    memset(cycles, 0, sizeof(cycles));
+    memset(gain, 0, sizeof(gain));
+    restart();
+  }
+
+  // every run starts uniform, the totals are kept for the report
+  void restart() {
+    draws = 0;
+
+    for (int i = 0; i < typeCount; i++) {
+      recentGain[i] = 0.0;
+      recentCycles[i] = 0.0;
+      cumWeight[i] = (i + 1.0) / typeCount;
+    }
+  }
+
+  // draws among the first count types, all of them by default
+  int next(XorShift &rng, int count = 0) {
+    if (++draws % SELECT_WINDOW == 0) {
+      adapt();
+    }
+
+    if (count <= 0 || count > typeCount) count = typeCount;
+
+    double r = rng.nextDouble() * cumWeight[count-1];
+    int type = 0;
+
+    while (type < count-1 && cumWeight[type] <= r) {
+      type++;
+    }
+
+    return type;
+  }
+
+  // the drawn move does not fit the current tour, its draw still took time
+  void reject(int type, ll spent) {
+    invalid[type]++;
+    cycles[type] += spent;
+    recentCycles[type] += spent;
+  }
+
+  void record(int type, double delta, bool applied, ll spent) {
+    proposed[type]++;
+    cycles[type] += spent;
+    recentCycles[type] += spent;
+
+    if (applied) {
+      accepted[type]++;
+
+      // a no-op move may come back a rounding error below zero
+      if (delta < -1e-9) {
+        improving[type]++;
+        gain[type] -= delta;
+        recentGain[type] -= delta;
+      }
+    }
+  }
+
+  void adapt() {
+    double rate[MAX_MOVE_TYPE];
+    double sum = 0.0;
+
+    for (int i = 0; i < typeCount; i++) {
+      rate[i] = (recentCycles[i] > 0.0)? recentGain[i] / recentCycles[i] : 0.0;
+      sum += rate[i];
+    }
+
+    double total = 0.0;
+
+    for (int i = 0; i < typeCount; i++) {
+      double share = (sum > 0.0)? rate[i] / sum : 1.0 / typeCount;
+
+      total += SELECT_FLOOR / typeCount + (1.0 - SELECT_FLOOR) * share;
+      cumWeight[i] = total;
+      recentGain[i] *= 0.5;
+      recentCycles[i] *= 0.5;
+    }
+  }
+
+  void report(const char *name) {
+    for (int i = 0; i < typeCount; i++) {
+      double micros = cycles[i] / (CYCLE_PER_SEC / 1e6);
+
+      fprintf(stderr,"moves %s %d: proposed = %lld, invalid = %lld, accepted = %lld, improving = %lld, gain/us = %f\n",
+          name, i, proposed[i], invalid[i], accepted[i], improving[i], (micros > 0.0)? gain[i] / micros : 0.0);
+    }
+  }
+};
+
+// open tour over the stars of one galaxy, each one is solved on its own thread
+struct ClusterTour {
+  double (*dist)[MAX_STAR];
+  XorShift rng;
+  vector<int> path;
+
+  ClusterTour (double (*dist)[MAX_STAR], vector<int> stars, unsigned long long seed, int stream) {
+    this->dist = dist;
+    this->path = stars;
+    this->rng.setSeed(seed, stream);
+  }
+
+  double edge(int from, int to) {
+    return (from < 0 || to < 0)? 0.0 : dist[from][to];
+  }
+
+  void nearestNeighbor() {
+    int size = path.size();
+
+    for (int i = 1; i < size; i++) {
+      int cid = path[i-1];
+      int index = i;
+
+      for (int j = i+1; j < size; j++) {
+        if (dist[cid][path[j]] < dist[cid][path[index]]) {
+          index = j;
+        }
+      }
+
+      swap(path[i], path[index]);
+    }
+  }
+
+  void solve(double timeLimit) {
+    int size = path.size();
+    if (size <= 3) return;
+
+    nearestNeighbor();
+
+    Annealer annealer(timeLimit);
+    vector<double> deltas;
+    ll tryCount = 0;
+
+    for (int k = 0; k < 1000; k++) {
+      int i, j;
+      deltas.push_back(twoOptDelta(i, j));
+    }
+    annealer.calibrate(deltas);
+
+    while (1) {
+      int i, j;
+      double delta = twoOptDelta(i, j);
+
+      if (annealer.accept(delta, rng)) {
+        reverse(path.begin()+i, path.begin()+j+1);
+      }
+
+      tryCount++;
+      if (tryCount % 100 == 0 && !annealer.update()) {
+        break;
+      }
+    }
+  }
+
+  // delta of reversing a random segment [i, j] of the open tour
+  double twoOptDelta(int &i, int &j) {
+    int size = path.size();
+
+    do {
+      i = rng.nextInt(size);
+      j = rng.nextInt(size);
+    } while (i == j);
+
+    if (i > j) swap(i, j);
+
+    int pi = (i == 0)? -1 : path[i-1];
+    int nj = (j == size-1)? -1 : path[j+1];
+
+    return edge(pi, path[j]) + edge(path[i], nj) - edge(pi, path[i]) - edge(path[j], nj);
+  }
+};
+
+// turns whose UFO moves are known, this one (sid -> nid) and the next (nid -> nnid)
+const int ROUTE_HORIZON = 2;
+const int MAX_KEY = MAX_SHIP + 3 * MAX_UFO;
+// cycles the route engine may spend per turn, about 0.2 ms
+const ll ROUTE_BUDGET = CYCLE_PER_SEC / 5000;
+// cycles the endgame path repair may spend per turn, about 0.5 ms
+const ll REPAIR_BUDGET = CYCLE_PER_SEC / 2000;
+// stars after the splice point smoothed by 2-opt
+const int REPAIR_WINDOW = 50;
+
+/*
+ * time-expanded cheapest routes of every ship over (star, turn) states for the
+ * turns whose UFO moves are known. by the triangle inequality a cheapest route
+ * only stops at ships and UFO positions, so a layer holds just those key stars.
+ * a step stays for free, flies directly at full cost or rides along with every
+ * UFO flying that edge, 0.001 each. ships left over when the budget runs out
+ * are answered by direct flights.
+ */
+struct RouteEngine {
+  double (*dist)[MAX_STAR];
+  int shipCount;
+  int keyCount;
+  int keys[MAX_KEY];
+  int keyOf[MAX_STAR];
+  int shipSid[MAX_SHIP];
+  bool solved[MAX_SHIP];
+  // cost[s][t][k]: cheapest energy of ship s to stand on key k after t turns
+  double cost[MAX_SHIP][ROUTE_HORIZON+1][MAX_KEY];
+  // the star ship s flies to this turn on that route
+  int firstHop[MAX_SHIP][ROUTE_HORIZON+1][MAX_KEY];
+  // UFO moves of every known turn
+  int ufoCount;
+  int ufoFrom[ROUTE_HORIZON][MAX_UFO];
+  int ufoTo[ROUTE_HORIZON][MAX_UFO];
+  ll builds;
+  ll cycles;
+  int capped;
+
+  RouteEngine () {
+    this->dist = NULL;
+    this->shipCount = 0;
+    this->keyCount = 0;
+    this->ufoCount = 0;
+    this->builds = 0;
+    this->cycles = 0;
+    this->capped = 0;
+    memset(this->keyOf, -1, sizeof(this->keyOf));
+  }
+
+  void addKey(int sid) {
+    if (keyOf[sid] >= 0) return;
+    keyOf[sid] = keyCount;
+    keys[keyCount++] = sid;
+  }
+
+  // ufos holds sid, nid, nnid of every UFO like the input
+  void build(double (*dist)[MAX_STAR], vector<int> &ships, vector<int> &ufos) {
+    ll startCycle = getCycle();
+
+    this->dist = dist;
+    this->shipCount = ships.size();
+    this->ufoCount = ufos.size() / 3;
+
+    for (int k = 0; k < keyCount; k++) {
+      keyOf[keys[k]] = -1;
+    }
+    keyCount = 0;
+
+    for (int i = 0; i < shipCount; i++) {
+      shipSid[i] = ships[i];
+      solved[i] = false;
+      addKey(ships[i]);
+    }
+    for (int u = 0; u < ufoCount; u++) {
+      for (int t = 0; t < ROUTE_HORIZON; t++) {
+        ufoFrom[t][u] = ufos[u*3+t];
+        ufoTo[t][u] = ufos[u*3+t+1];
+      }
+      for (int t = 0; t <= ROUTE_HORIZON; t++) {
+        addKey(ufos[u*3+t]);
+      }
+    }
+
+    for (int i = 0; i < shipCount; i++) {
+      if (getCycle() - startCycle > ROUTE_BUDGET) {
+        capped++;
+        break;
+      }
+      solveShip(i);
+      solved[i] = true;
+    }
+
+    builds++;
+    cycles += getCycle() - startCycle;
+  }
+
+  void solveShip(int s) {
+    for (int t = 0; t <= ROUTE_HORIZON; t++) {
+      for (int k = 0; k < keyCount; k++) {
+        cost[s][t][k] = DBL_MAX;
+        firstHop[s][t][k] = -1;
+      }
+    }
+
+    cost[s][0][keyOf[shipSid[s]]] = 0.0;
+    firstHop[s][0][keyOf[shipSid[s]]] = shipSid[s];
+
+    for (int t = 0; t < ROUTE_HORIZON; t++) {
+      double *from = cost[s][t];
+      double *to = cost[s][t+1];
+
+      for (int k = 0; k < keyCount; k++) {
+        if (from[k] == DBL_MAX) continue;
+
+        int hop = firstHop[s][t][k];
+
+        for (int l = 0; l < keyCount; l++) {
+          double c = from[k] + dist[keys[k]][keys[l]];
+
+          if (c < to[l]) {
+            to[l] = c;
+            firstHop[s][t+1][l] = (t == 0)? keys[l] : hop;
+          }
+        }
+      }
+
+      for (int u = 0; u < ufoCount; u++) {
+        int a = keyOf[ufoFrom[t][u]];
+        int b = keyOf[ufoTo[t][u]];
+        if (from[a] == DBL_MAX) continue;
+
+        // the discount stacks over every UFO on the same edge
+        double factor = 1.0;
+        for (int v = 0; v < ufoCount; v++) {
+          if (ufoFrom[t][v] == ufoFrom[t][u] && ufoTo[t][v] == ufoTo[t][u]) factor *= 0.001;
+        }
+
+        double c = from[a] + dist[keys[a]][keys[b]] * factor;
+
+        if (c < to[b]) {
+          to[b] = c;
+          firstHop[s][t+1][b] = (t == 0)? keys[b] : firstHop[s][t][a];
+        }
+      }
+    }
+  }
+
+  /*
+   * cheapest energy for ship s to stand on star sid within the given turns, or
+   * DBL_MAX. hop is the star to fly to this turn, the ship star itself to wait.
+   */
+  double reach(int s, int sid, int turns, int &hop) {
+    double best = DBL_MAX;
+    hop = -1;
+
+    if (sid == shipSid[s]) {
+      hop = sid;
+      return 0.0;
+    }
+    if (turns <= 0) return best;
+
+    if (!solved[s]) {
+      hop = sid;
+      return dist[shipSid[s]][sid];
+    }
+
+    int key = keyOf[sid];
+
+    for (int t = 0; t <= ROUTE_HORIZON && t <= turns; t++) {
+      for (int k = 0; k < keyCount; k++) {
+        double c = cost[s][t][k];
+        if (c == DBL_MAX) continue;
+
+        if (k == key && c < best) {
+          best = c;
+          hop = firstHop[s][t][k];
+        }
+        if (t < turns && c + dist[keys[k]][sid] < best) {
+          best = c + dist[keys[k]][sid];
+          hop = (t == 0)? sid : firstHop[s][t][k];
+        }
+      }
+    }
+
+    return best;
+  }
+};
+
+/*
+ * held-karp lower bound of the endgame, subgradient optimization over 1-trees.
+ * every ship has a start node at its star and a free end node, a solution is a
+ * tour start -> stars -> end -> next start -> ... in which ends cost nothing
+ * and are never adjacent, starts are never adjacent either. it runs on its own
+ * thread next to the search, bound holds the best value so far.
+ */
+struct LowerBound {
+  double (*dist)[MAX_STAR];
+  int shipCount;
+  // nodes are [0, shipCount) ends, [shipCount, 2*shipCount) starts, then stars
+  vector<int> node;
+  double upperBound;
+  atomic<double> bound;
+  atomic<bool> stop;
+
+  LowerBound (double (*dist)[MAX_STAR], vector<int> ships, vector<int> &stars, double upperBound) {
+    this->dist = dist;
+    this->shipCount = ships.size();
+    this->node.assign(shipCount, -1);
+    this->node.insert(this->node.end(), ships.begin(), ships.end());
+    this->node.insert(this->node.end(), stars.begin(), stars.end());
+    this->upperBound = upperBound;
+    this->bound = 0.0;
+    this->stop = false;
+  }
+
+  double cost(int u, int v) {
+    const double FORBIDDEN = 1e7;
+
+    if (u < shipCount && v < shipCount) return FORBIDDEN;
+    if (u < shipCount || v < shipCount) return 0.0;
+    if (u < 2*shipCount && v < 2*shipCount) return FORBIDDEN;
+    return dist[node[u]][node[v]];
+  }
+
+  void solve() {
+    int n = node.size();
+    if (n < 3) return;
+
+    vector<double> pi(n, 0.0);
+    vector<int> degree(n);
+    double best = 0.0;
+    double lambda = 2.0;
+    int stall = 0;
+
+    for (int iter = 0; iter < 1000 && !stop; iter++) {
+      double value = oneTree(pi, degree);
+      int norm = 0;
+
+      if (value > best) {
+        best = value;
+        bound = best;
+        stall = 0;
+      } else if (++stall >= 20) {
+        lambda *= 0.5;
+        stall = 0;
+      }
+
+      for (int i = 0; i < n; i++) {
+        norm += (degree[i] - 2) * (degree[i] - 2);
+      }
+
+      // a 1-tree with all degrees 2 is a tour, nothing left to gain
+      if (norm == 0 || lambda < 1e-4) break;
+
+      double step = lambda * (upperBound - value) / norm;
+
+      for (int i = 0; i < n; i++) {
+        pi[i] += step * (degree[i] - 2);
+      }
+    }
+  }
+
+  // prim over the nodes 1 .. n-1, node 0 joins by its two cheapest edges
+  double oneTree(vector<double> &pi, vector<int> &degree) {
+    int n = pi.size();
+    vector<double> key(n, DBL_MAX);
+    vector<int> parent(n, -1);
+    vector<bool> inTree(n, false);
+    double total = 0.0;
+    double piSum = 0.0;
+
+    degree.assign(n, 0);
+    key[1] = 0.0;
+
+    for (int k = 1; k < n; k++) {
+      int u = -1;
+
+      for (int v = 1; v < n; v++) {
+        if (!inTree[v] && (u < 0 || key[v] < key[u])) {
+          u = v;
+        }
+      }
+
+      inTree[u] = true;
+      total += key[u];
+      if (parent[u] >= 0) {
+        degree[u]++;
+        degree[parent[u]]++;
+      }
+
+      for (int v = 1; v < n; v++) {
+        if (inTree[v]) continue;
+
+        double c = cost(u, v) + pi[u] + pi[v];
+
+        if (c < key[v]) {
+          key[v] = c;
+          parent[v] = u;
+        }
+      }
+    }
+
+    int v1 = -1, v2 = -1;
+    double c1 = DBL_MAX, c2 = DBL_MAX;
+
+    for (int v = 1; v < n; v++) {
+      double c = cost(0, v) + pi[0] + pi[v];
+
+      if (c < c1) {
+        c2 = c1;
+        v2 = v1;
+        c1 = c;
+        v1 = v;
+      } else if (c < c2) {
+        c2 = c;
+        v2 = v;
+      }
+    }
+
+    total += c1 + c2;
+    degree[0] = 2;
+    degree[v1]++;
+    degree[v2]++;
+
+    for (int i = 0; i < n; i++) {
+      piSum += pi[i];
+    }
+
+    return total - 2.0 * piSum;
+  }
+};
+
+const unsigned int CACHE_MAGIC = 0x31435453;
+const int CACHE_VERSION = 1;
+// near stars kept per star, enough to fill NEAR_SIZE from most endgame subsets
+const int CACHE_NEAR = 16;
+const size_t CACHE_HEADER_SIZE = 64;
+
+struct CacheHeader {
+  unsigned int magic;
+  int version;
+  int starCount;
+  // near stars per star in a .bin file, stars in a .tour file
+  int count;
+  unsigned long long hash;
+  double length;
+};
+
+/*
+ * optional cache of per-instance work in the directory named by STAR_CACHE,
+ * keyed by a hash of the star coordinates. <hash>.bin holds the near lists and
+ * the distance rows in hilbert numbering and is mapped read-only, concurrent
+ * runs share one copy. <hash>.tour holds the best known endgame tour. a file is
+ * written under a temporary name and renamed, nobody reads half of one.
+ */
+struct InstanceCache {
+  const char *dir;
+  unsigned long long hash;
+  int starCount;
+  int nearCount;
+  void *map;
+  size_t mapSize;
+  StarIndex (*nearList)[CACHE_NEAR];
+  double (*distTable)[MAX_STAR];
+
+  InstanceCache () {
+    this->dir = NULL;
+    this->hash = 0;
+    this->starCount = 0;
+    this->nearCount = 0;
+    this->map = NULL;
+    this->mapSize = 0;
+    this->nearList = NULL;
+    this->distTable = NULL;
+  }
+
+  ~InstanceCache () {
+    unmap();
+  }
+
+  void unmap() {
+    if (map != NULL) {
+      munmap(map, mapSize);
+    }
+    map = NULL;
+    nearList = NULL;
+    distTable = NULL;
+  }
+
+  size_t distOffset() {
+    size_t nearBytes = (size_t)starCount * CACHE_NEAR * sizeof(StarIndex);
+    return CACHE_HEADER_SIZE + (nearBytes + 63) / 64 * 64;
+  }
+
+  size_t binSize() {
+    return distOffset() + (size_t)starCount * MAX_STAR * sizeof(double);
+  }
+
+  std::string path(const char *ext) {
+    char name[64];
+    snprintf(name, sizeof(name), "/%016llx.%s", hash, ext);
+    return std::string(dir) + name;
+  }
+
+  // maps <hash>.bin, false when it is missing or was made for something else
+  bool open(const char *dir, unsigned long long hash, int starCount) {
+    unmap();
+    this->dir = dir;
+    this->hash = hash;
+    this->starCount = starCount;
+
+    int fd = ::open(path("bin").c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != binSize()) {
+      close(fd);
+      return false;
+    }
+
+    void *data = mmap(NULL, binSize(), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    CacheHeader *header = (CacheHeader*)data;
+    if (header->magic != CACHE_MAGIC || header->version != CACHE_VERSION
+        || header->hash != hash || header->starCount != starCount
+        || header->count < 0 || header->count > min(CACHE_NEAR, starCount-1)) {
+      munmap(data, binSize());
+      return false;
+    }
+
+    // a near list pointing past the stars is as bad as no cache
+    StarIndex (*near)[CACHE_NEAR] = (StarIndex (*)[CACHE_NEAR])((char*)data + CACHE_HEADER_SIZE);
+
+    for (int i = 0; i < starCount; i++) {
+      for (int k = 0; k < header->count; k++) {
+        if (near[i][k] >= starCount) {
+          munmap(data, binSize());
+          return false;
+        }
+      }
+    }
+
+    map = data;
+    mapSize = binSize();
+    nearCount = header->count;
+    nearList = near;
+    distTable = (double (*)[MAX_STAR])((char*)data + distOffset());
+
+    return true;
+  }
+
+  void write(double (*dist)[MAX_STAR]) {
+    std::string name = path("bin");
+    std::string temp = name + ".tmp" + std::to_string((long long)getpid());
+    FILE *fp = fopen(temp.c_str(), "wb");
+
+    if (fp == NULL) {
+      fprintf(stderr,"cannot write %s\n", temp.c_str());
+      return;
+    }
+
+    CacheHeader header = {CACHE_MAGIC, CACHE_VERSION, starCount, min(CACHE_NEAR, starCount-1), hash, 0.0};
+    vector<char> block(distOffset(), 0);
+    StarIndex (*near)[CACHE_NEAR] = (StarIndex (*)[CACHE_NEAR])(&block[0] + CACHE_HEADER_SIZE);
+    vector< pair<double, int> > cand(starCount);
+
+    memcpy(&block[0], &header, sizeof(header));
+
+    for (int i = 0; i < starCount; i++) {
+      for (int j = 0; j < starCount; j++) {
+        cand[j] = make_pair((i == j)? DBL_MAX : dist[i][j], j);
+      }
+
+      partial_sort(cand.begin(), cand.begin()+header.count, cand.end());
+
+      for (int k = 0; k < header.count; k++) {
+        near[i][k] = cand[k].second;
+      }
+    }
+
+    bool ok = fwrite(&block[0], 1, block.size(), fp) == block.size();
+
+    for (int i = 0; i < starCount && ok; i++) {
+      ok = fwrite(dist[i], sizeof(double), MAX_STAR, fp) == (size_t)MAX_STAR;
+    }
+
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(temp.c_str(), name.c_str()) != 0) {
+      fprintf(stderr,"cannot write %s\n", name.c_str());
+      remove(temp.c_str());
+    }
+  }
+
+  // the best known tour as internal star ids, empty without one
+  vector<int> loadTour(double &length) {
+    vector<int> tour;
+    if (dir == NULL) return tour;
+
+    FILE *fp = fopen(path("tour").c_str(), "rb");
+    if (fp == NULL) return tour;
+
+    CacheHeader header;
+
+    if (fread(&header, sizeof(header), 1, fp) == 1 && header.magic == CACHE_MAGIC
+        && header.version == CACHE_VERSION && header.hash == hash
+        && header.starCount == starCount && header.count > 0 && header.count <= starCount) {
+      vector<StarIndex> ids(header.count);
+      vector<bool> seen(starCount, false);
+      bool ok = fread(&ids[0], sizeof(StarIndex), header.count, fp) == (size_t)header.count;
+
+      // a star out of range or twice in the tour is as bad as no tour
+      for (int i = 0; i < header.count && ok; i++) {
+        ok = ids[i] < starCount && !seen[ids[i]];
+        if (ok) seen[ids[i]] = true;
+      }
+
+      if (ok) {
+        tour.assign(ids.begin(), ids.end());
+        length = header.length;
+      }
+    }
+
+    fclose(fp);
+
+    return tour;
+  }
+
+  void saveTour(vector<int> &tour, double length) {
+    if (dir == NULL || tour.empty()) return;
+
+    std::string name = path("tour");
+    std::string temp = name + ".tmp" + std::to_string((long long)getpid());
+    FILE *fp = fopen(temp.c_str(), "wb");
+    if (fp == NULL) return;
+
+    CacheHeader header = {CACHE_MAGIC, CACHE_VERSION, starCount, (int)tour.size(), hash, length};
+    vector<StarIndex> ids(tour.begin(), tour.end());
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+      && fwrite(&ids[0], sizeof(StarIndex), ids.size(), fp) == ids.size();
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(temp.c_str(), name.c_str()) != 0) {
+      fprintf(stderr,"cannot write %s\n", name.c_str());
+      remove(temp.c_str());
+    }
+  }
+};
+
+// all solver state of one StarTraveller instance, nothing is shared between instances
+struct Context {
+  // distTable rows are allocated per instance for starCount stars, or mapped from the cache
+  double (*distTable)[MAX_STAR];
+  InstanceCache cache;
+  unsigned long long seed;
+  XorShift rng;
+
+  // stars are renumbered along a hilbert curve, external ids only appear in the protocol
+  int starY[MAX_STAR];
+  int starX[MAX_STAR];
+  unsigned long long visited[(MAX_STAR+63)/64];
+  int toInternal[MAX_STAR];
+  int toExternal[MAX_STAR];
+  Ship shipList[MAX_SHIP];
+  UFO ufoList[MAX_UFO];
+  // path is an open path flown from the anchor star (-1 for a free start)
+  vector<int> path;
+  int psize;
+  int anchor;
+
+  // near stars of every endgame star and its place in the ship paths, narrow like the tours
+  StarIndex nearList[MAX_STAR][NEAR_SIZE];
+  int nearSize;
+  uint8_t routeOf[MAX_STAR];
+  StarIndex posOf[MAX_STAR];
+
+  // multi ship solutions, preallocated so restarts and snapshots never allocate
+  GiantTour giant;
+  GiantTour goodTour;
+  GiantTour bestTour;
+  GiantTour endgameTour;
+  GiantTour startTour[3];
+
+  // unvisited stars in hilbert order form a tour whose length estimates the endgame
+  int unvisitedPrev[MAX_STAR];
+  int unvisitedNext[MAX_STAR];
+  double tourEstimate;
+  double tourGainRate;
+  double energyRate;
+  double lastTurnCost;
+  int switchStreak;
+
+  // UFO landings per star, the base of the coverage estimate
+  int ufoVisits[MAX_STAR];
+  int ufoLandings;
+
+  int turn;
+  int starCount;
+  int shipCount;
+  int ufoCount;
+  int timeLimit;
+  int remainCount;
+  // stars a ship can still visit in TSP mode, one per turn
+  int routeLimit;
+  int rideLine;
+  int crewCount;
+  double currentCost;
+  bool TSPMode;
+  bool checkFlag;
+  bool reported;
+  Params params;
+
+  // energy and newly visited stars of every ship by move type
+  double energy[MAX_SHIP][MOVE_TYPE_COUNT];
+  int newStars[MAX_SHIP][MOVE_TYPE_COUNT];
+  bool warning;
+  double totalTime;
+  double remainTime;
+
+  RouteEngine router;
+
+  // move statistics of TSPSolver and MTSPSolver over all their runs
+  MoveSelector tspMoves;
+  MoveSelector multiMoves;
+
+  Context () {
+    this->distTable = NULL;
+    this->seed = 0;
+    this->psize = 0;
+    this->anchor = -1;
+    this->nearSize = 0;
+    this->tourEstimate = 0.0;
+    this->tourGainRate = 0.0;
+    this->ufoLandings = 0;
+    this->energyRate = 0.0;
+    this->lastTurnCost = 0.0;
+    this->switchStreak = 0;
+    this->turn = 0;
+    this->starCount = 0;
+    this->shipCount = 0;
+    this->ufoCount = 0;
+    this->timeLimit = 0;
+    this->remainCount = 0;
+    this->routeLimit = MAX_STAR;
+    this->rideLine = 0;
+    this->crewCount = 0;
+    this->currentCost = 0.0;
+    this->TSPMode = false;
+    this->checkFlag = false;
+    this->reported = false;
+    this->warning = false;
+    this->totalTime = 0.0;
+    this->remainTime = 0.0;
+    this->tspMoves.init(4);
+    this->multiMoves.init(11);
+    memset(this->visited, 0, sizeof(this->visited));
+    memset(this->ufoVisits, 0, sizeof(this->ufoVisits));
+    memset(this->energy, 0, sizeof(this->energy));
+    memset(this->newStars, 0, sizeof(this->newStars));
+  }
+
+  ~Context () {
+    releaseDistTable();
+  }
+
+  void releaseDistTable() {
+    if (cache.distTable == NULL) {
+      delete[] distTable;
+    }
+    cache.unmap();
+    distTable = NULL;
+  }
+
+  Context (const Context&) = delete;
+  Context &operator=(const Context&) = delete;
+};
 
 class StarTraveller {
   public:
+    Context ctx;
     vector<int> used;
 
+    // must be called before init, workers derive their streams from this seed
+    void setSeed(unsigned long long seed) {
+      ctx.seed = seed;
+    }
+
     int init(vector<int> stars) {
       ll startCycle = getCycle();
 
-      g_starCount = stars.size()/2;
-      used.resize(g_starCount, 0);
-      g_turn = 0;
-      g_totalTime = 0.0;
-      g_crewCount = 0;
-      g_timeLimit = g_starCount * 4;
-      g_currentCost = 0.0;
-      g_remainCount = g_starCount;
-      g_checkFlag = false;
-      g_TSPMode = false;
-      g_warning = false;
-      vector<int> path;
+      ctx.rng.setSeed(ctx.seed, 0);
+      ctx.starCount = stars.size()/2;
+      ctx.params = Params();
+      used.resize(ctx.starCount, 0);
+      ctx.turn = 0;
+      ctx.totalTime = 0.0;
+      ctx.crewCount = 0;
+      ctx.timeLimit = ctx.starCount * 4;
+      ctx.currentCost = 0.0;
+      ctx.remainCount = ctx.starCount;
+      ctx.checkFlag = false;
+      ctx.reported = false;
+      ctx.TSPMode = false;
+      ctx.warning = false;
+      memset(ctx.visited, 0, sizeof(ctx.visited));
+      memset(ctx.ufoVisits, 0, sizeof(ctx.ufoVisits));
+      ctx.ufoLandings = 0;
+      memset(ctx.energy, 0, sizeof(ctx.energy));
+      memset(ctx.newStars, 0, sizeof(ctx.newStars));
+
+      ctx.releaseDistTable();
+      renumberStars(stars);
+
+      const char *cacheDir = getenv("STAR_CACHE");
+
+      if (cacheDir != NULL && ctx.cache.open(cacheDir, hashStars(stars), ctx.starCount)) {
+        ctx.distTable = ctx.cache.distTable;
+        fprintf(stderr,"cache hit %016llx\n", ctx.cache.hash);
+      } else {
+        ctx.distTable = new double[ctx.starCount][MAX_STAR];
+        setupDistTable();
 
-      for (int i = 0; i < g_starCount; i++) {
+        if (cacheDir != NULL) {
+          ctx.cache.write(ctx.distTable);
+        }
+      }
+
+      setupTourEstimate();
+
+      double currentTime = getTime(startCycle);
+
+      ctx.totalTime += currentTime;
+      fprintf(stderr,"setup completed %f\n", ctx.totalTime);
+
+      return 0;
+    }
+
+    // fnv-1a over the coordinates in input order
+    unsigned long long hashStars(vector<int> &stars) {
+      unsigned long long hash = 14695981039346656037ULL;
+
+      for (int i = 0; i < (int)stars.size(); i++) {
+        hash = (hash ^ (unsigned int)stars[i]) * 1099511628211ULL;
+      }
+
+      return hash;
+    }
+
+    void renumberStars(vector<int> &stars) {
+      vector< pair<int, int> > order(ctx.starCount);
+
+      for (int i = 0; i < ctx.starCount; i++) {
         int x = stars[i*2];
         int y = stars[i*2+1];
 
-        g_starList.push_back(Star(y,x));
-        path.push_back(i);
+        order[i] = make_pair(hilbertOrder(y, x), i);
       }
 
-      setupDistTable();
+      sort(order.begin(), order.end());
 
-      double currentTime = getTime(startCycle);
+      for (int i = 0; i < ctx.starCount; i++) {
+        int eid = order[i].second;
 
-      g_totalTime += currentTime;
-      fprintf(stderr,"setup completed %f\n", g_totalTime);
+        ctx.starX[i] = stars[eid*2];
+        ctx.starY[i] = stars[eid*2+1];
+        ctx.toInternal[eid] = i;
+        ctx.toExternal[i] = eid;
+      }
+    }
 
-      return 0;
+    void translateInput(vector<int> &ids) {
+      int size = ids.size();
+
+      for (int i = 0; i < size; i++) {
+        ids[i] = ctx.toInternal[ids[i]];
+      }
     }
 
     void setupDistTable() {
-      for (int i = 0; i < g_starCount-1; i++) {
-        Star *from = getStar(i);
+      for (int i = 0; i < ctx.starCount; i++) {
+        ctx.distTable[i][i] = 0.0;
+        for (int j = i+1; j < ctx.starCount; j++) {
+          double dist = calcDist(ctx.starY[i], ctx.starX[i], ctx.starY[j], ctx.starX[j]);
+
+          ctx.distTable[i][j] = dist;
+          ctx.distTable[j][i] = dist;
+        }
+      }
+    }
+
+    void setupTourEstimate() {
+      ctx.tourEstimate = 0.0;
+      ctx.tourGainRate = 0.0;
+      ctx.energyRate = 0.0;
+      ctx.lastTurnCost = 0.0;
+      ctx.switchStreak = 0;
 
-        DIST_TABLE[i][i] = 0.0;
-        for (int j = i+1; j < g_starCount; j++) {
-          Star *to = getStar(j);
-          double dist = calcDist(from->y, from->x, to->y, to->x);
+      for (int i = 0; i < ctx.starCount; i++) {
+        ctx.unvisitedPrev[i] = i-1;
+        ctx.unvisitedNext[i] = (i+1 < ctx.starCount)? i+1 : -1;
 
-          DIST_TABLE[i][j] = dist;
-          DIST_TABLE[j][i] = dist;
+        if (i > 0) {
+          ctx.tourEstimate += ctx.distTable[i-1][i];
         }
       }
     }
 
+    // O(1) update of the hilbert tour when a star is visited
+    void removeFromTourEstimate(int sid) {
+      int prev = ctx.unvisitedPrev[sid];
+      int next = ctx.unvisitedNext[sid];
+
+      ctx.tourEstimate -= removeGain(sid);
+
+      if (prev >= 0) ctx.unvisitedNext[prev] = next;
+      if (next >= 0) ctx.unvisitedPrev[next] = prev;
+    }
+
+    double removeGain(int sid) {
+      int prev = ctx.unvisitedPrev[sid];
+      int next = ctx.unvisitedNext[sid];
+
+      return edgeDist(prev, sid) + edgeDist(sid, next) - edgeDist(prev, next);
+    }
+
+    /*
+     * compares how fast riding UFOs shrinks the estimated endgame tour with the
+     * energy spent per turn, both as moving averages. once riding stops paying
+     * for itself for a while the endgame is started. only the last phase is
+     * judged, earlier phases change the ride rules and are not predictable.
+     */
+    bool updateSwitchEstimate(double tourGain) {
+      const double alpha = 0.002;
+
+      ctx.tourGainRate += alpha * (HILBERT_RATIO * tourGain - ctx.tourGainRate);
+      ctx.energyRate += alpha * (ctx.lastTurnCost - ctx.energyRate);
+
+      if (ctx.turn >= 3*ctx.starCount && ctx.tourGainRate < ctx.energyRate) {
+        ctx.switchStreak++;
+      } else {
+        ctx.switchStreak = 0;
+      }
+
+      return ctx.switchStreak >= SWITCH_STREAK;
+    }
+
+    // instance classes follow the ship and UFO thresholds of setParameter
+    int shipBucket() {
+      if (ctx.shipCount == 1) return 0;
+      if (ctx.shipCount <= 3) return 1;
+      if (ctx.shipCount <= 6) return 2;
+      return 3;
+    }
+
+    int ufoBucket() {
+      if (ctx.ufoCount <= 1) return ctx.ufoCount;
+      if (ctx.ufoCount <= 5) return 2;
+      return 3;
+    }
+
+    int starBucket() {
+      return ctx.starCount / 700;
+    }
+
+    /*
+     * reads the file named by STAR_PARAMS. "class <ships> <ufos> <stars>" starts
+     * a section for one instance class given by its buckets (-1 matches any), the
+     * "key = value" lines before the first class line apply to every instance.
+     */
+    void loadParams() {
+      const char *filename = getenv("STAR_PARAMS");
+      if (filename == NULL) return;
+
+      FILE *fp = fopen(filename, "r");
+      if (fp == NULL) {
+        fprintf(stderr,"cannot open %s\n", filename);
+        return;
+      }
+
+      char line[256];
+      char key[64];
+      double value;
+      int s, u, b;
+      bool match = true;
+
+      while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, " class %d %d %d", &s, &u, &b) == 3) {
+          match = (s < 0 || s == shipBucket()) && (u < 0 || u == ufoBucket()) && (b < 0 || b == starBucket());
+        } else if (match && sscanf(line, " %63s = %lf", key, &value) == 2) {
+          double *param = ctx.params.find(key);
+
+          if (param == NULL) {
+            fprintf(stderr,"unknown parameter %s\n", key);
+          } else {
+            *param = value;
+          }
+        }
+      }
+
+      fclose(fp);
+    }
+
     void setParameter() {
-      if (g_shipCount <= 3 && g_ufoCount == 1) {
-        g_rideLine = 756;
-      } else if (g_turn <= g_starCount) {
-        if (g_shipCount <= 6) {
-          g_rideLine = 64;
+      Params &p = ctx.params;
+
+      if (ctx.shipCount <= 3 && ctx.ufoCount == 1) {
+        ctx.rideLine = p.rideLineSolo;
+      } else if (ctx.turn <= ctx.starCount) {
+        if (ctx.shipCount <= 6) {
+          ctx.rideLine = p.rideLineEarly;
         } else {
-          g_rideLine = 32;
+          ctx.rideLine = p.rideLineEarlyMany;
         }
-      } else if (g_crewCount >= g_shipCount) {
-        if (g_shipCount <= 6) {
-          g_rideLine = 16;
+      } else if (ctx.crewCount >= ctx.shipCount) {
+        if (ctx.shipCount <= 6) {
+          ctx.rideLine = p.rideLineFull;
         } else {
-          g_rideLine = 0;
+          ctx.rideLine = p.rideLineFullMany;
         }
       } else {
-        g_rideLine = 256;
+        ctx.rideLine = p.rideLineLate;
       }
     } 
 
@@ -193,56 +1634,115 @@ class StarTraveller {
       ll startCycle = getCycle();
       double currentTime;
 
-      g_turn++;
-      g_timeLimit--;
+      ctx.turn++;
+      ctx.timeLimit--;
+
+      ctx.ufoCount = ufos.size() / 3;
+      ctx.shipCount = ships.size();
 
-      g_ufoCount = ufos.size() / 3;
-      g_shipCount = ships.size();
+      translateInput(ufos);
+      translateInput(ships);
 
-      if (g_turn > 1) {
+      if (ctx.turn == 1) {
+        loadParams();
+        fprintf(stderr,"instance = %d %d %d\n", shipBucket(), ufoBucket(), starBucket());
+      }
+
+      double tourBefore = ctx.tourEstimate;
+
+      if (ctx.turn > 1) {
         checkVisited(ships);
       }
 
+      bool switchByEstimate = updateSwitchEstimate(tourBefore - ctx.tourEstimate);
+
       setParameter();
       updateUFOInfo(ufos);
       updateShipInfo(ships);
+      ctx.router.build(ctx.distTable, ships, ufos);
+
+      /*
+       * the switch is forced once the ships can no longer share the stars left
+       * within the turns left, the endgame keeps every route under that limit.
+       */
+      double sharingShips = max(1.0, min((double)ctx.shipCount, ctx.params.switchShips));
 
-      if (!g_TSPMode && g_remainCount > g_timeLimit) {
-        g_TSPMode = true;
-        fprintf(stderr,"remain count = %d\n", g_remainCount);
+      if (!ctx.TSPMode && (ctx.remainCount > sharingShips * ctx.timeLimit || switchByEstimate)) {
+        ctx.TSPMode = true;
+        fprintf(stderr,"remain count = %d, estimated tour = %f\n", ctx.remainCount, HILBERT_RATIO * ctx.tourEstimate);
       }
-      if (g_turn >= 3*g_starCount) {
-        g_warning = true;
+      if (ctx.turn >= 3*ctx.starCount) {
+        ctx.warning = true;
       }
 
-      if (g_TSPMode && !g_checkFlag) {
+      if (ctx.TSPMode && !ctx.checkFlag) {
         vector<int> path = getUnvisitedStarList();
-        g_checkFlag = true;
+        ctx.checkFlag = true;
 
         currentTime = getTime(startCycle);
-        fprintf(stderr,"TSP mode %f\n", g_totalTime + currentTime);
+        fprintf(stderr,"TSP mode %f\n", ctx.totalTime + currentTime);
 
-        g_path = path;
-        g_psize = path.size();
+        ctx.path = path;
+        ctx.psize = path.size();
+        ctx.routeLimit = ctx.timeLimit + 1;
+        ctx.anchor = getShip(nearestShip(path))->sid;
 
         vector<int> firstPath = nearestNeighbor(path);
         currentTime = getTime(startCycle);
-        fprintf(stderr,"nearestNeighbor completed %f\n", g_totalTime + currentTime);
+        fprintf(stderr,"nearestNeighbor completed %f\n", ctx.totalTime + currentTime);
 
         vector<int> secondPath = selectBestFI(path);
+        anchorPath(firstPath);
         currentTime = getTime(startCycle);
-        fprintf(stderr,"selectBestFI completed %f\n", g_totalTime + currentTime);
+        fprintf(stderr,"selectBestFI completed %f\n", ctx.totalTime + currentTime);
+
+        vector<int> cachedPath = cachedTour(path);
 
-        if (g_shipCount == 1) {
+        if (!cachedPath.empty()) {
+          anchorPath(cachedPath);
+          ctx.path = cachedPath;
+          double cachedDist = calcPathDist();
+          ctx.path = firstPath;
+          double firstDist = calcPathDist();
+
+          fprintf(stderr,"cached tour = %f, nearest neighbor = %f\n", cachedDist, firstDist);
+          if (cachedDist < firstDist) {
+            firstPath = cachedPath;
+          }
+        }
+
+        vector<int> ships(1, ctx.anchor);
+
+        if (ctx.shipCount > 1) {
+          ships.clear();
+          for (int i = 0; i < ctx.shipCount; i++) {
+            ships.push_back(getShip(i)->sid);
+          }
+        }
+
+        /*
+         * the bound gets its own thread only with a core to spare, otherwise it
+         * would halve the annealing. a run short enough to share one core ends
+         * several percent off, far from stopping anything, so none is made.
+         */
+        ctx.path = firstPath;
+        LowerBound lowerBound(ctx.distTable, ships, path, calcPathDist());
+        thread boundWorker;
+
+        if (thread::hardware_concurrency() > 1) {
+          boundWorker = thread([&lowerBound]() { lowerBound.solve(); });
+        }
+
+        if (ctx.shipCount == 1) {
           double minScore = DBL_MAX;
           vector<int> bestPath, pathA;
 
           currentTime = getTime(startCycle);
-          g_remainTime = MAX_TIME - (g_totalTime + currentTime);
-          fprintf(stderr,"remain time %f\n", g_remainTime);
+          ctx.remainTime = MAX_TIME - (ctx.totalTime + currentTime);
+          fprintf(stderr,"remain time %f\n", ctx.remainTime);
 
-          int retryCount = 10;
-          double span = (0.9 * g_remainTime) / retryCount;
+          int retryCount = max(1, (int)ctx.params.retrySingle);
+          double span = (ctx.params.solveRatio * ctx.remainTime) / retryCount;
 
           fprintf(stderr,"span time = %f\n" ,span);
 
@@ -252,57 +1752,93 @@ class StarTraveller {
             } else {
               pathA = TSPSolver(secondPath, span);
             }
+            ctx.path = pathA;
             double score = calcPathDist();
 
             if (minScore > score) {
               minScore = score;
               bestPath = pathA;
             }
+
+            if (closeToBound(lowerBound, minScore)) {
+              break;
+            }
           }
 
-          g_shipList[0].path = bestPath;
-          cleanPathSingle(0);
+          ctx.shipList[0].path = bestPath;
+          storeTour(bestPath);
         } else {
-          vector< vector<int> > bestPaths(g_shipCount);
-          vector< vector<int> > paths(g_shipCount);
+          vector< vector<int> > paths(ctx.shipCount);
           double minScore = DBL_MAX;
-          vector<int> pathA = TSPSolver(firstPath, 2.5);
-          vector<int> pathB = TSPSolver(secondPath, 2.5);
+          setupNearList(path);
+          double firstTime = ctx.params.firstSolveTime;
+          vector<int> pathA = TSPSolver(firstPath, firstTime);
+          vector<int> pathB = TSPSolver(secondPath, firstTime);
+          vector< vector<int> > pathC = clusterFirstPaths(path, firstTime);
+
+          paths = splitTour(pathA);
+          ctx.startTour[0].assign(paths);
+          paths = splitTour(pathB);
+          ctx.startTour[1].assign(paths);
+          ctx.startTour[2].assign(pathC);
+          storeTour(pathA);
 
           currentTime = getTime(startCycle);
-          g_remainTime = MAX_TIME - (g_totalTime + currentTime);
-          fprintf(stderr,"remain time %f\n", g_remainTime);
-          int retryCount = 20;
-          double span = (0.9 * g_remainTime) / retryCount;
+          ctx.remainTime = MAX_TIME - (ctx.totalTime + currentTime);
+          fprintf(stderr,"remain time %f\n", ctx.remainTime);
+          int retryCount = max(1, (int)ctx.params.retryMulti);
+          double span = (ctx.params.solveRatio * ctx.remainTime) / retryCount;
 
           fprintf(stderr,"span time = %f\n" ,span);
 
           for (int i = 0; i < retryCount; i++) {
-            if (i % 2 == 0) {
-              paths = MTSPSolver(pathA, span);
-            } else {
-              paths = MTSPSolver(pathB, span);
-            }
-            double score = calcPathDistMulti();
+            double score = MTSPSolver(ctx.startTour[i % 3], span);
 
             if (minScore > score) {
               minScore = score;
-              bestPaths = paths;
+              ctx.endgameTour.copyFrom(ctx.bestTour);
+            }
+
+            if (closeToBound(lowerBound, minScore)) {
+              break;
             }
           }
 
-          for (int i = 0; i < g_shipCount; i++) {
-            g_shipList[i].path = bestPaths[i];
-          }
+          GiantTour &tour = ctx.endgameTour;
+
+          for (int i = 0; i < ctx.shipCount; i++) {
+            StarIndex *route = tour.tour + tour.start[i];
+            ctx.shipList[i].path.assign(route, route + tour.size(i));
+          }
+
+          repairRoutes();
+
+          currentTime = getTime(startCycle);
+          fprintf(stderr,"TSP create completed %f\n", ctx.totalTime + currentTime);
+        }
+
+        lowerBound.stop = true;
+        if (boundWorker.joinable()) {
+          boundWorker.join();
+        }
+
+        // without a bound there is no gap, a zero would read as a perfect tour
+        double bound = lowerBound.bound;
+        if (bound > 0.0) {
+          fprintf(stderr,"endgame_bound = %f\n", bound);
+          fprintf(stderr,"endgame_gap = %f\n", (endgameScore() - bound) / bound);
+        }
 
-          currentTime = getTime(startCycle);
-          fprintf(stderr,"TSP create completed %f\n", g_totalTime + currentTime);
+        ctx.tspMoves.report("tsp");
+        if (ctx.shipCount > 1) {
+          ctx.multiMoves.report("multi");
         }
       }
 
-      if (g_turn == 1) {
+      if (ctx.turn == 1) {
         moveShipFirst(ships);
-      } else if (g_TSPMode) {
+      } else if (ctx.TSPMode) {
+        repairEndgamePaths();
         moveShip();
       } else {
         moveShipWithUFO();
@@ -311,18 +1847,129 @@ class StarTraveller {
       vector<int> ret = getOutput();
 
       currentTime = getTime(startCycle);
-      g_totalTime += currentTime;
+      ctx.totalTime += currentTime;
 
       return ret;
     }
 
+    // the cached tour cut down to the given stars, the stars it lacks by cheapest insertion
+    vector<int> cachedTour(vector<int> &stars) {
+      double length = 0.0;
+      vector<int> cached = ctx.cache.loadTour(length);
+      if (cached.empty()) return cached;
+
+      vector<bool> member(ctx.starCount, false);
+      for (int i = 0; i < (int)stars.size(); i++) {
+        member[stars[i]] = true;
+      }
+
+      vector<int> tour;
+      for (int i = 0; i < (int)cached.size(); i++) {
+        if (member[cached[i]]) {
+          tour.push_back(cached[i]);
+          member[cached[i]] = false;
+        }
+      }
+
+      for (int i = 0; i < (int)stars.size(); i++) {
+        if (member[stars[i]]) {
+          insertCheapest(tour, stars[i]);
+        }
+      }
+
+      return tour;
+    }
+
+    /*
+     * merges the stars of the cached tour that the endgame did not need into its
+     * tour, so the cache grows toward a tour over all stars. an equal star set
+     * only replaces the cached tour when it is shorter.
+     */
+    void storeTour(vector<int> &endgame) {
+      if (ctx.cache.dir == NULL) return;
+
+      double cachedLength = 0.0;
+      vector<int> cached = ctx.cache.loadTour(cachedLength);
+      vector<int> tour = endgame;
+      vector<bool> member(ctx.starCount, false);
+
+      for (int i = 0; i < (int)tour.size(); i++) {
+        member[tour[i]] = true;
+      }
+      for (int i = 0; i < (int)cached.size(); i++) {
+        if (!member[cached[i]]) {
+          insertCheapest(tour, cached[i]);
+        }
+      }
+
+      double length = 0.0;
+      for (int i = 1; i < (int)tour.size(); i++) {
+        length += ctx.distTable[tour[i-1]][tour[i]];
+      }
+
+      if (tour.size() == cached.size() && length >= cachedLength) return;
+
+      ctx.cache.saveTour(tour, length);
+      fprintf(stderr,"cached tour saved, %d stars, length %f\n", (int)tour.size(), length);
+    }
+
+    // inserts the star where it lengthens the open tour the least
+    void insertCheapest(vector<int> &tour, int sid) {
+      int size = tour.size();
+      int index = 0;
+      double minCost = DBL_MAX;
+
+      for (int i = 0; i <= size; i++) {
+        int prev = (i == 0)? -1 : tour[i-1];
+        int next = (i == size)? -1 : tour[i];
+        double cost = edgeDist(prev, sid) + edgeDist(sid, next) - edgeDist(prev, next);
+
+        if (minCost > cost) {
+          minCost = cost;
+          index = i;
+        }
+      }
+
+      tour.insert(tour.begin() + index, sid);
+    }
+
+    /*
+     * reports the gap of the best restart to the lower bound so far, the search
+     * stops once it is small enough and the rest of the time budget stays unused.
+     * with free end nodes the multi ship bound stays about 10% off, so only a
+     * single ship stops early.
+     */
+    bool closeToBound(LowerBound &lowerBound, double score) {
+      double bound = lowerBound.bound;
+      if (bound <= 0.0) return false;
+
+      double gap = (score - bound) / bound;
+      fprintf(stderr,"lower bound = %f, gap = %f\n", bound, gap);
+
+      return ctx.shipCount == 1 && gap < ctx.params.gapThreshold;
+    }
+
+    double endgameScore() {
+      double score = 0.0;
+
+      for (int i = 0; i < ctx.shipCount; i++) {
+        Ship *ship = getShip(i);
+        int sid = ship->sid;
+
+        for (int j = 0; j < (int)ship->path.size(); j++) {
+          score += ctx.distTable[sid][ship->path[j]];
+          sid = ship->path[j];
+        }
+      }
+
+      return score;
+    }
+
     vector<int> getUnvisitedStarList() {
       vector<int> path;
 
-      for (int i = 0; i < g_starCount; i++) {
-        Star *star = getStar(i);
-
-        if (!star->visited) {
+      for (int i = 0; i < ctx.starCount; i++) {
+        if (!isVisited(i)) {
           path.push_back(i);
         }
       }
@@ -335,13 +1982,13 @@ class StarTraveller {
       ll startCycle = getCycle();
       vector<int> result;
 
-      for (int i = 0; i < g_psize; i++) {
-        g_path = createFirstPath(path, i);
+      for (int i = 0; i < ctx.psize; i++) {
+        ctx.path = createFirstPath(path, i);
         double dist = calcPathDist();
 
         if (minDist > dist) {
           minDist = dist;
-          result = g_path;
+          result = ctx.path;
         }
 
         double currentTime = getTime(startCycle);
@@ -354,17 +2001,18 @@ class StarTraveller {
     }
 
     vector<int> selectBestFI(vector<int> &path) {
-      g_psize = path.size();
+      ctx.psize = path.size();
       double minScore = DBL_MAX;
       ll startCycle = getCycle();
       vector<int> bestPath;
 
-      for (int i = 0; i < g_psize; i++) {
-        g_path = farthestInsertion(path, i);
+      for (int i = 0; i < ctx.psize; i++) {
+        ctx.path = farthestInsertion(path, i);
+        anchorPath(ctx.path);
         double score = calcPathDist();
 
         if (minScore > score) {
-          bestPath = g_path;
+          bestPath = ctx.path;
           minScore = score;
         }
 
@@ -398,7 +2046,7 @@ class StarTraveller {
           double mmd = DBL_MAX;
 
           for (int j = 0; j < rsize; j++) {
-            mmd = min(mmd, DIST_TABLE[m][result[j]]);
+            mmd = min(mmd, ctx.distTable[m][result[j]]);
           }
 
           if (md < mmd) {
@@ -416,9 +2064,9 @@ class StarTraveller {
         for (int j = 0; j < rsize; j++) {
           int aid = (j+1)%rsize;
 
-          double d1 = DIST_TABLE[result[j]][sid];
-          double d2 = DIST_TABLE[sid][result[aid]];
-          double d3 = DIST_TABLE[result[j]][result[aid]];
+          double d1 = ctx.distTable[result[j]][sid];
+          double d2 = ctx.distTable[sid][result[aid]];
+          double d3 = ctx.distTable[result[j]][result[aid]];
           double dist = d1 + d2 - d3;
 
           if (minDist > dist) {
@@ -451,7 +2099,7 @@ class StarTraveller {
 
           if (checkList[id]) continue;
 
-          double dist = DIST_TABLE[cid][id];
+          double dist = ctx.distTable[cid][id];
 
           if (minDist > dist) {
             minDist = dist;
@@ -467,17 +2115,17 @@ class StarTraveller {
     }
 
     void checkVisited(vector<int> &ships) {
-      for (int i = 0; i < g_shipCount; i++) {
-        Star *star = getStar(ships[i]);
-        if (star->visited) continue;
+      for (int i = 0; i < ctx.shipCount; i++) {
+        if (isVisited(ships[i])) continue;
 
-        star->visited = true;
-        g_remainCount--;
+        setVisited(ships[i]);
+        removeFromTourEstimate(ships[i]);
+        ctx.remainCount--;
       }
     }
 
     void updateUFOInfo(vector<int> &ufos) {
-      for (int i = 0; i < g_ufoCount; i++) {
+      for (int i = 0; i < ctx.ufoCount; i++) {
         UFO *ufo = getUFO(i);
 
         ufo->sid = ufos[i*3];
@@ -485,135 +2133,314 @@ class StarTraveller {
         ufo->nnid = ufos[i*3+2];
         ufo->rideoff = false;
 
-        double dist = DIST_TABLE[ufo->sid][ufo->nid];
+        double dist = ctx.distTable[ufo->sid][ufo->nid];
 
         ufo->totalMoveDist += dist;
         ufo->totalCount++;
+        ctx.ufoVisits[ufo->nid]++;
+        ctx.ufoLandings++;
       }
     }
 
     void updateShipInfo(vector<int> &ships) {
-      for (int i = 0; i < g_shipCount; i++) {
+      for (int i = 0; i < ctx.shipCount; i++) {
         Ship *ship = getShip(i);
         ship->sid = ships[i];
+        ship->move = MOVE_STAY;
       }
     }
 
     void moveShipFirst(vector<int> &ships) {
-      for (int i = 0; i < g_shipCount; i++) {
+      for (int i = 0; i < ctx.shipCount; i++) {
         Ship *ship = getShip(i);
         ship->nid = ships[i];
       }
     }
 
     void moveShip() {
-      for (int i = 0; i < g_shipCount; i++) {
+      for (int i = 0; i < ctx.shipCount; i++) {
         Ship *ship = getShip(i);
         if (ship->path.size() == 0) continue;
 
         ship->nid = ship->path[0];
+        ship->move = MOVE_ENDGAME;
         ship->path.erase(ship->path.begin());
       }
     }
 
-    void moveShipWithUFO() {
-      map<int, double> distList;
+    /*
+     * a ship in TSP mode rides to a star of its own path when a UFO flies there
+     * within the known turns and that beats flying the path, as long as the path
+     * still fits into the turns left. the path then goes on from that star, with
+     * the stars before it in order or reversed, and 2-opt smooths the next stars.
+     * with turns to spare a UFO star off the path may also be a stop on the way.
+     */
+    void repairEndgamePaths() {
+      ll startCycle = getCycle();
+      RouteEngine &router = ctx.router;
+      int turnsLeft = ctx.timeLimit + 1;
+      vector<int> pos(ctx.starCount, -1);
 
-      for (int j = 0; j < g_ufoCount; j++) {
-        UFO *ufo = getUFO(j);
-        Star *nstar = getStar(ufo->nid);
+      for (int i = 0; i < ctx.shipCount; i++) {
+        if (getCycle() - startCycle > REPAIR_BUDGET) break;
 
-        if (ufo->capacity <= ufo->crew && g_turn <= 3*g_starCount) continue;
+        Ship *ship = getShip(i);
+        vector<int> &path = ship->path;
+        int size = path.size();
+        if (size == 0) continue;
 
-        double minDist = (ufo->crew == 0)? DBL_MAX : 0.1;
-        int shipId = -1;
+        for (int p = 0; p < size; p++) {
+          pos[path[p]] = p;
+        }
 
-        for (int i = 0; i < g_shipCount; i++) {
-          Ship *ship = getShip(i);
-          double dist = DIST_TABLE[ufo->nid][ship->sid];
-
-          if (ship->uid >= 0) {
-            UFO *mfo = getUFO(ship->uid);
-            Star *onstar = getStar(mfo->nid);
-            Star *onnstar = getStar(mfo->nid);
-
-            if (ufo->crew > 0) continue;
-            if (g_shipCount > 3) continue;
-            if (ship->uid == j) continue;
-            if (DIST_TABLE[ship->sid][ufo->nid] > 10.0) continue;
-            if (!onstar->visited || !onnstar->visited) continue;
-            if (g_turn <= g_starCount) continue;
-
-            if (mfo->averageMoveDist() < ufo->averageMoveDist()) {
-              ship->uid = j;
-              mfo->crew--;
-              ufo->crew++;
+        int hop;
+        double base = router.reach(i, path[0], 1, hop);
+        double maxGain = 1.0;
+        int bestStar = -1, bestPos = -1, bestHop = -1;
+        bool bestReverse = false;
+
+        for (int k = 0; k < router.keyCount; k++) {
+          int x = router.keys[k];
+          int p = pos[x];
+          // a star off the path takes one more turn
+          int turns = size + ((p < 0)? 1 : 0);
+
+          if (x == ship->sid || turns > turnsLeft) continue;
+
+          // the path after x minus the path before, for both ways through the stars before x
+          double forward, backward = DBL_MAX;
+
+          if (p < 0) {
+            forward = ctx.distTable[x][path[0]];
+          } else {
+            int prev = (p > 0)? path[p-1] : -1;
+            int next = (p+1 < size)? path[p+1] : -1;
+
+            forward = edgeDist(x, (p > 0)? path[0] : next) - edgeDist(prev, x) - edgeDist(x, next) + edgeDist(prev, next);
+            if (p > 0) {
+              backward = edgeDist(x, prev) - edgeDist(prev, x) - edgeDist(x, next) + edgeDist(path[0], next);
             }
+          }
 
-            continue;
+          double cost1 = router.reach(i, x, 1, hop);
+          double cost = cost1;
+          int first = -1;
+
+          // waiting or a stop on the way takes one more turn
+          if (turns < turnsLeft) {
+            double cost2 = router.reach(i, x, 2, hop);
+
+            if (cost2 < cost1 - 1e-9 && hop != x) {
+              cost = cost2;
+              first = hop;
+            }
           }
+          if (cost == DBL_MAX) continue;
+
+          if (base - cost - forward > maxGain) {
+            maxGain = base - cost - forward;
+            bestStar = x;
+            bestPos = p;
+            bestHop = first;
+            bestReverse = false;
+          }
+          if (base - cost - backward > maxGain) {
+            maxGain = base - cost - backward;
+            bestStar = x;
+            bestPos = p;
+            bestHop = first;
+            bestReverse = true;
+          }
+        }
+
+        for (int p = 0; p < size; p++) {
+          pos[path[p]] = -1;
+        }
 
-          if (ufo->crew == 1 && existAroundStar(ship->sid)) continue;
+        if (bestStar < 0) continue;
 
-          if (minDist > dist) {
-            minDist = dist;
-            shipId = i;
+        int x = bestStar;
+        vector<int> npath;
+
+        if (bestHop >= 0) npath.push_back(bestHop);
+        npath.push_back(x);
+        if (bestPos < 0) {
+          npath.insert(npath.end(), path.begin(), path.end());
+        } else {
+          if (bestReverse) {
+            npath.insert(npath.end(), path.rbegin() + (size - bestPos), path.rend());
+          } else {
+            npath.insert(npath.end(), path.begin(), path.begin() + bestPos);
           }
+          npath.insert(npath.end(), path.begin() + bestPos + 1, path.end());
         }
 
-        if (shipId >= 0 && minDist <= g_rideLine) {
-          Ship *ship = getShip(shipId);
-          double ndist = DIST_TABLE[ship->sid][ufo->nnid];
+        twoOptWindow(npath, (bestHop >= 0)? 1 : 0, REPAIR_WINDOW);
 
-          if (!nstar->visited || minDist < ndist) {
-            fprintf(stderr,"turn %d: ship %d ride on ufo %d, dist = %f\n", g_turn, shipId, j, minDist);
-            ship->nid = ufo->nid;
+        fprintf(stderr,"turn %d: ship %d rides to star %d, gain = %f\n", ctx.turn, i, x, maxGain);
+        path = npath;
+      }
+    }
+
+    // first improvement 2-opt on the window stars behind path[from], path[from] stays
+    void twoOptWindow(vector<int> &path, int from, int window) {
+      int end = min((int)path.size() - 1, from + window);
+      bool improved = true;
+
+      while (improved) {
+        improved = false;
+
+        for (int i = from+1; i < end; i++) {
+          for (int j = i+1; j <= end; j++) {
+            int after = (j+1 < (int)path.size())? path[j+1] : -1;
+            double delta = ctx.distTable[path[i-1]][path[j]] + edgeDist(path[i], after)
+              - ctx.distTable[path[i-1]][path[i]] - edgeDist(path[j], after);
+
+            if (delta < -1e-9) {
+              reverse(path.begin() + i, path.begin() + j + 1);
+              improved = true;
+            }
+          }
+        }
+      }
+    }
+
+    void moveShipWithUFO() {
+      for (int j = 0; j < ctx.ufoCount; j++) {
+        UFO *ufo = getUFO(j);
+
+        if (ufo->capacity <= ufo->crew && ctx.turn <= 3*ctx.starCount) continue;
+
+        for (int i = 0; i < ctx.shipCount; i++) {
+          Ship *ship = getShip(i);
+          if (ship->uid < 0) continue;
+
+          UFO *mfo = getUFO(ship->uid);
+
+          if (ufo->crew > 0) continue;
+          if (ctx.shipCount > 3) continue;
+          if (ship->uid == j) continue;
+          if (ctx.distTable[ship->sid][ufo->nid] > ctx.params.transferDist) continue;
+          if (!isVisited(mfo->nid) || !isVisited(mfo->nid)) continue;
+          if (ctx.turn <= ctx.starCount) continue;
+
+          if (mfo->averageMoveDist() < ufo->averageMoveDist()) {
             ship->uid = j;
-            g_ufoList[j].crew++;
-            g_crewCount++;
+            ship->move = MOVE_TRANSFER;
+            mfo->crew--;
+            ufo->crew++;
           }
         }
       }
 
-      for (int i = 0; i < g_shipCount; i++) {
+      assignShipToUFO();
+
+      for (int i = 0; i < ctx.shipCount; i++) {
         Ship *ship = getShip(i);
 
         if (ship->uid >= 0) {
           UFO *ufo = getUFO(ship->uid);
-          Star *nstar = getStar(ufo->nid);
 
-          if (ship->sid == ufo->sid && ufo->sid == ufo->nnid && nstar->visited) {
+          if (ship->sid == ufo->sid && ufo->sid == ufo->nnid && isVisited(ufo->nid)) {
             ship->nid = ufo->sid;
-          } else if (ufo->crew >= 2 && !ufo->rideoff && existAroundStar(ship->sid) && existAroundShip(ship->sid)) {
-            fprintf(stderr,"turn %d: ship %d ride off ufo %d\n", g_turn, i, ship->uid);
+          } else if (ufo->crew >= 2 && !ufo->rideoff && existAroundStar(ship->sid, ctx.params.coverLimit) && existAroundShip(ship->sid)) {
+            fprintf(stderr,"turn %d: ship %d ride off ufo %d\n", ctx.turn, i, ship->uid);
             ship->uid = -1;
             ship->nid = ufo->sid;
+            ship->move = MOVE_RIDEOFF;
             ufo->crew--;
             ufo->rideoff = true;
           } else {
             ship->nid = ufo->nid;
+
+            // ships that just boarded or transferred keep that type
+            if (ship->move == MOVE_STAY) {
+              ship->move = MOVE_RIDE;
+            }
           }
         }
       }
     }
 
-    vector< vector<int> > MTSPSolver(vector<int> stars, double timeLimit) {
-      vector< vector<int> > bestPaths(g_shipCount);
+    /*
+     * boards free ships on UFOs by an exact min-cost matching of ships x (UFOs + stay).
+     * every UFO takes at most one new ship per turn, staying costs 0 and a feasible
+     * boarding costs its distance minus the ride line and the value of the UFO.
+     */
+    void assignShipToUFO() {
+      const double INF = 1e9;
+      vector<int> freeShips;
+
+      for (int i = 0; i < ctx.shipCount; i++) {
+        if (getShip(i)->uid < 0) {
+          freeShips.push_back(i);
+        }
+      }
+
+      int fsize = freeShips.size();
+      if (fsize == 0 || ctx.ufoCount == 0) return;
+
+      vector< vector<double> > cost(fsize, vector<double>(ctx.ufoCount + fsize, 0.0));
+
+      for (int r = 0; r < fsize; r++) {
+        Ship *ship = getShip(freeShips[r]);
+        bool aroundStar = existAroundStar(ship->sid, 1.0);
+
+        for (int j = 0; j < ctx.ufoCount; j++) {
+          UFO *ufo = getUFO(j);
+          int hop;
+          // flying there may ride along another UFO
+          double dist = ctx.router.reach(freeShips[r], ufo->nid, 1, hop);
+          double ndist = ctx.distTable[ship->sid][ufo->nnid];
+
+          cost[r][j] = INF;
+
+          if (ufo->capacity <= ufo->crew && ctx.turn <= 3*ctx.starCount) continue;
+          if (ufo->crew > 0 && dist >= 0.1) continue;
+          if (ufo->crew == 1 && aroundStar) continue;
+          if (dist > ctx.rideLine) continue;
+          if (isVisited(ufo->nid) && dist >= ndist) continue;
+
+          // stars UFOs rarely land on are the rare chances to ride there
+          double value = 1.0;
+          if (!isVisited(ufo->nid)) value += 8.0 + ctx.params.coverValue * (1.0 - coverage(ufo->nid));
+          if (!isVisited(ufo->nnid)) value += 4.0;
+          value += 0.5 * max(0, ufo->capacity - ufo->crew);
+
+          cost[r][j] = dist - ctx.rideLine - value;
+        }
+      }
+
+      vector<int> match = solveAssignment(cost);
 
-      for (int i = 0; i < g_shipCount; i++) {
-        bestPaths[i].clear();
-        g_shipList[i].path.clear();
+      for (int r = 0; r < fsize; r++) {
+        int j = match[r];
+        if (j < 0 || j >= ctx.ufoCount || cost[r][j] >= INF) continue;
+
+        int shipId = freeShips[r];
+        Ship *ship = getShip(shipId);
+        UFO *ufo = getUFO(j);
+
+        fprintf(stderr,"turn %d: ship %d ride on ufo %d, dist = %f\n",
+            ctx.turn, shipId, j, ctx.distTable[ufo->nid][ship->sid]);
+        ship->nid = ufo->nid;
+        ship->uid = j;
+        ship->move = MOVE_BOARD;
+        ufo->crew++;
+        ctx.crewCount++;
       }
+    }
 
+    int nearestShip(vector<int> &stars) {
       double minDist = DBL_MAX;
-      int minId = -1;
+      int minId = 0;
       int psize = stars.size();
 
-      for (int i = 0; i < g_shipCount; i++) {
+      for (int i = 0; i < ctx.shipCount; i++) {
         Ship *ship = getShip(i);
 
         for (int j = 0; j < psize; j++) {
-          double dist = DIST_TABLE[ship->sid][stars[j]];
+          double dist = ctx.distTable[ship->sid][stars[j]];
 
           if (minDist > dist) {
             minDist = dist;
@@ -622,177 +2449,632 @@ class StarTraveller {
         }
       }
 
-      bestPaths[minId] = stars;
-      g_shipList[minId].path = stars;
-      vector<int> goodPath = stars;
+      return minId;
+    }
+
+    // anneals from the given routes, leaves the best ones in ctx.bestTour
+    double MTSPSolver(GiantTour &init, double timeLimit) {
+      GiantTour &g = ctx.giant;
+      const int shipCount = ctx.shipCount;
+
+      g.copyFrom(init);
+      ctx.goodTour.copyFrom(init);
+      ctx.bestTour.copyFrom(init);
+      updateRouteIndex(0, shipCount-1);
+
       int c1, c2;
       int s1, s2;
 
       double bestScore = calcPathDistMulti();
+      for (int i = 0; i < shipCount; i++) {
+        bestScore += overflowCost(g.size(i));
+      }
       double goodScore = bestScore;
 
-      ll startCycle = getCycle();
-      double currentTime;
+      Annealer annealer(timeLimit);
+      calibrateMulti(annealer);
+      MoveSelector &selector = ctx.multiMoves;
+      selector.restart();
       ll tryCount = 0;
 
       int type;
       double newScore = 0.0;
-      double subScore = 0.0;
+      bool dirtyIndex = false;
 
       while(1) {
-        if (g_psize > 1) {
+        ll moveStart = getCycle();
+
+        if (ctx.psize > 1) {
           do {
-            c1 = xor128() % g_psize;
-            c2 = xor128() % g_psize;
+            c1 = ctx.rng.nextInt(ctx.psize);
+            c2 = ctx.rng.nextInt(ctx.psize);
           } while (c1 == c2);
         } else {
           c1 = 0;
           c2 = 0;
         }
 
-        do {
-          s1 = xor128() % g_shipCount;
-          s2 = xor128() % g_shipCount;
-        } while (s1 == s2);
+        s1 = ctx.rng.nextInt(shipCount);
+        s2 = (s1 + 1 + ctx.rng.nextInt(shipCount-1)) % shipCount;
 
-        type = xor128()%8;
-        Ship *ship1 = getShip(s1);
-        Ship *ship2 = getShip(s2);
-        int size1 = ship1->path.size();
-        int size2 = ship2->path.size();
+        // the neighbor moves 8.. need near stars, a single star left has none
+        type = selector.next(ctx.rng, (ctx.nearSize > 0)? 0 : 8);
+
+        // repair: an overflowing ship hands its tail to the shortest route, not a draw of the selector
+        bool repair = false;
+
+        if (g.size(s1) > ctx.routeLimit && type < 8) {
+          s2 = (s1 == 0)? 1 : 0;
+          for (int i = 0; i < shipCount; i++) {
+            if (i != s1 && g.size(i) < g.size(s2)) s2 = i;
+          }
+          type = 3;
+          repair = true;
+        }
+
+        int size1 = g.size(s1);
+
+        if (type >= 8) {
+          if (size1 == 0) {
+            selector.reject(type, getCycle() - moveStart);
+            continue;
+          }
+
+          if (dirtyIndex) {
+            updateRouteIndex(0, shipCount-1);
+            dirtyIndex = false;
+          }
+
+          int a = g.tour[g.start[s1] + ctx.rng.nextInt(size1)];
+          int c = ctx.nearList[a][ctx.rng.nextInt(ctx.nearSize)];
+          int s3 = ctx.routeOf[c];
+
+          if (s3 == s1) {
+            selector.reject(type, getCycle() - moveStart);
+            continue;
+          }
+
+          tryCount++;
+          double threshold = annealer.threshold(ctx.rng);
+          double delta = 0.0;
+          bool applied = false;
+
+          switch(type) {
+            case 8:
+              applied = exchangeSegment(a, c, 1 + ctx.rng.nextInt(3), 0, threshold, delta);
+              break;
+            case 9:
+              applied = twoOptStar(a, c, threshold, delta);
+              break;
+            case 10:
+              applied = exchangeSegment(a, c, 1 + ctx.rng.nextInt(3), 1 + ctx.rng.nextInt(3), threshold, delta);
+              break;
+          }
+
+          if (applied) {
+            goodScore += delta;
+            ctx.goodTour.copyRoutes(g, s1, s3);
+
+            if (bestScore > goodScore) {
+              bestScore = goodScore;
+              ctx.bestTour.copyFrom(ctx.goodTour);
+            }
+          }
+
+          selector.record(type, delta, applied, getCycle() - moveStart);
+
+          if (tryCount % 10 == 0 && !annealer.update()) {
+            break;
+          }
 
-        if (type <= 1 && size1 <= max(c1, c2)) {
           continue;
+        }
+
+        bool invalid = false;
+
+        if (type <= 1 && size1 <= max(c1, c2)) {
+          invalid = true;
         } else if (type == 0 && size1 <= 2) {
-          continue;
+          invalid = true;
         } else if (type == 1 && size1 <= 1) {
-          continue;
+          invalid = true;
         } else if (type == 2 && size1 == 0) {
-          continue;
+          invalid = true;
         } else if (type == 3 && size1 == 0) {
-          continue;
+          invalid = true;
         } else if (type == 4 && size1 <= 1) {
-          continue;
+          invalid = true;
         } else if (type == 5 && size1 == 0) {
-          continue;
+          invalid = true;
         } else if (type == 6 && size1 <= 1) {
-          continue;
+          invalid = true;
         } else if (type == 7 && size1 <= 2) {
+          invalid = true;
+        }
+
+        if (invalid) {
+          selector.reject(type, getCycle() - moveStart);
           continue;
         }
 
-        tryCount++;
+        tryCount++;
+
+        // moves only touch ship1 and ship2
+        StarIndex *route1 = g.tour + g.start[s1];
+        double subScore = routeDist(s1) + routeDist(s2)
+          + overflowCost(size1) + overflowCost(g.size(s2));
+
+        switch(type) {
+          case 0:
+            reverse(route1 + min(c1, c2), route1 + max(c1, c2) + 1);
+            break;
+          case 1:
+            swap(route1[c1], route1[c2]);
+            break;
+          case 2:
+            insertStarMulti(s1, s2);
+            break;
+          case 3:
+            cutPath(s1, s2);
+            break;
+          case 4:
+            reverse(route1, route1 + size1);
+            break;
+          case 5:
+            cutPathReverse(s1, s2);
+            break;
+          case 6:
+            if (!insertStarMulti2(s1, s2)) {
+              selector.reject(type, getCycle() - moveStart);
+              continue;
+            }
+            break;
+          case 7:
+            insertStarMS(s1);
+            break;
+        }
+
+        newScore = goodScore + routeDist(s1) + routeDist(s2)
+          + overflowCost(g.size(s1)) + overflowCost(g.size(s2)) - subScore;
+
+        double delta = newScore - goodScore;
+        bool accepted = annealer.accept(delta, ctx.rng);
+
+        if (accepted) {
+          goodScore = newScore;
+          ctx.goodTour.copyRoutes(g, s1, s2);
+          dirtyIndex = true;
+
+          if (bestScore > goodScore) {
+            bestScore = goodScore;
+            ctx.bestTour.copyFrom(ctx.goodTour);
+          }
+        } else {
+          g.copyRoutes(ctx.goodTour, s1, s2);
+        }
+
+        if (!repair) {
+          selector.record(type, delta, accepted, getCycle() - moveStart);
+        }
+
+        if (tryCount % 10 == 0 && !annealer.update()) {
+          break;
+        }
+      }
+
+      fprintf(stderr,"tryCount = %lld, path size = %d, pathDist = %f\n",
+          tryCount, ctx.psize, bestScore + ctx.currentCost);
+
+      return bestScore;
+    }
+
+    /*
+     * cuts a giant tour into at most one contiguous segment per ship, every segment
+     * flown from whichever end is nearer to its ship and no longer than the turns
+     * left. for a fixed order of the ships along the tour the cheapest cut is an
+     * O(n * ships) dp. the order then follows
+     * an optimal assignment of the segments to the ships until the cost stops falling.
+     */
+    vector< vector<int> > splitTour(vector<int> &tour) {
+      int n = tour.size();
+      int k = ctx.shipCount;
+      vector< vector<int> > bestPaths(k);
+      vector< pair<int, int> > order(k);
+      double bestCost = DBL_MAX;
+
+      if (n == 0) return bestPaths;
+
+      for (int i = 0; i < k; i++) {
+        int sid = getShip(i)->sid;
+        int pos = 0;
+
+        for (int j = 1; j < n; j++) {
+          if (ctx.distTable[sid][tour[j]] < ctx.distTable[sid][tour[pos]]) {
+            pos = j;
+          }
+        }
+        order[i] = make_pair(pos, i);
+      }
+
+      for (int iter = 0; iter < 10; iter++) {
+        sort(order.begin(), order.end());
+
+        vector<int> ships(k);
+        for (int i = 0; i < k; i++) {
+          ships[i] = order[i].second;
+        }
+
+        vector< vector<int> > segments;
+        double cost = splitTourOrdered(tour, ships, segments);
+
+        if (cost >= bestCost - 1e-9) break;
+
+        bestCost = cost;
+        bestPaths.assign(k, vector<int>());
+
+        int m = segments.size();
+        vector< vector<double> > assignCost(m, vector<double>(k));
+        vector<double> length(m, 0.0);
+
+        for (int s = 0; s < m; s++) {
+          vector<int> &seg = segments[s];
+
+          for (int j = 1; j < (int)seg.size(); j++) {
+            length[s] += ctx.distTable[seg[j-1]][seg[j]];
+          }
+          for (int i = 0; i < k; i++) {
+            int sid = getShip(i)->sid;
+            assignCost[s][i] = length[s] + min(ctx.distTable[sid][seg.front()], ctx.distTable[sid][seg.back()]);
+          }
+        }
+
+        vector<int> match = solveAssignment(assignCost);
+        vector<bool> used(k, false);
+
+        for (int s = 0; s < m; s++) {
+          int i = match[s];
+          int sid = getShip(i)->sid;
+
+          bestPaths[i] = segments[s];
+          if (ctx.distTable[sid][segments[s].back()] < ctx.distTable[sid][segments[s].front()]) {
+            reverse(bestPaths[i].begin(), bestPaths[i].end());
+          }
+          order[s] = make_pair(s, i);
+          used[i] = true;
+        }
+
+        int index = m;
+        for (int i = 0; i < k; i++) {
+          if (!used[i]) {
+            order[index++] = make_pair(m, i);
+          }
+        }
+      }
+
+      fprintf(stderr,"split tour cost = %f\n", bestCost + ctx.currentCost);
+
+      return bestPaths;
+    }
+
+    // the dp of splitTour, ships[j] takes the j-th segment along the tour or none
+    double splitTourOrdered(vector<int> &tour, vector<int> &ships, vector< vector<int> > &segments) {
+      int n = tour.size();
+      int k = ships.size();
+      vector<double> prefix(n, 0.0);
+      vector< vector<double> > dp(k+1, vector<double>(n+1, DBL_MAX));
+      vector< vector<int> > from(k+1, vector<int>(n+1, -1));
+
+      for (int i = 1; i < n; i++) {
+        prefix[i] = prefix[i-1] + ctx.distTable[tour[i-1]][tour[i]];
+      }
+
+      // segments are at most limit stars long, unless the stars cannot be covered anyway
+      int limit = ctx.routeLimit;
+      if ((ll)limit * k < n) limit = n;
+
+      dp[0][0] = 0.0;
+
+      for (int j = 1; j <= k; j++) {
+        int sid = getShip(ships[j-1])->sid;
+        // window minima of dp[j-1][a] - prefix[a] over b-limit <= a < b, flown forward from a or backward
+        deque< pair<double, int> > forward, backward;
+
+        for (int b = 0; b <= n; b++) {
+          dp[j][b] = dp[j-1][b];
+          from[j][b] = b;
+
+          while (!forward.empty() && forward.front().second < b - limit) forward.pop_front();
+          while (!backward.empty() && backward.front().second < b - limit) backward.pop_front();
+
+          if (!forward.empty()) {
+            double f = prefix[b-1] + forward.front().first;
+
+            if (f < dp[j][b]) {
+              dp[j][b] = f;
+              from[j][b] = forward.front().second;
+            }
+          }
+          if (!backward.empty()) {
+            double r = prefix[b-1] + backward.front().first + ctx.distTable[sid][tour[b-1]];
+
+            if (r < dp[j][b]) {
+              dp[j][b] = r;
+              from[j][b] = backward.front().second;
+            }
+          }
+
+          if (b < n && dp[j-1][b] < DBL_MAX) {
+            double base = dp[j-1][b] - prefix[b];
+            double f = base + ctx.distTable[sid][tour[b]];
+
+            while (!forward.empty() && forward.back().first >= f) forward.pop_back();
+            forward.push_back(make_pair(f, b));
+            while (!backward.empty() && backward.back().first >= base) backward.pop_back();
+            backward.push_back(make_pair(base, b));
+          }
+        }
+      }
+
+      segments.clear();
+
+      for (int j = k, b = n; j > 0; j--) {
+        int a = from[j][b];
+
+        if (a < b) {
+          segments.push_back(vector<int>(tour.begin()+a, tour.begin()+b));
+        }
+        b = a;
+      }
+
+      reverse(segments.begin(), segments.end());
 
-        switch(type) {
-          case 0:
-            reconnectPath(c1, c2, ship1->path);
-            break;
-          case 1:
-            subScore = calcSubPathDist(c1) + calcSubPathDist(c2);
-            swapStar(c1, c2, ship1->path);
-            break;
-          case 2:
-            insertStarMulti(ship1, ship2);
-            break;
-          case 3:
-            cutPath(ship1, ship2);
-            break;
-          case 4:
-            reversePath(ship1);
-            break;
-          case 5:
-            cutPathReverse(ship1, ship2);
-            break;
-          case 6:
-            insertStarMulti2(ship1, ship2);
-            break;
-          case 7:
-            insertStarMS(ship1->path);
-            break;
+      return dp[k][n];
+    }
+
+    /*
+     * cluster first, route second: splits the stars into galaxies, solves every
+     * galaxy tour on its own thread and chains the tours to the ships.
+     */
+    vector< vector<int> > clusterFirstPaths(vector<int> &stars, double timeLimit) {
+      vector< vector<int> > clusters = clusterStars(stars);
+      int csize = clusters.size();
+      int total = stars.size();
+      vector<ClusterTour> tours;
+
+      for (int i = 0; i < csize; i++) {
+        tours.push_back(ClusterTour(ctx.distTable, clusters[i], ctx.seed, i+1));
+      }
+
+      int threadCount = max(1, min((int)thread::hardware_concurrency(), csize));
+      vector<thread> workers;
+
+      for (int t = 0; t < threadCount; t++) {
+        workers.push_back(thread([&tours, t, threadCount, csize, total, timeLimit]() {
+          for (int i = t; i < csize; i += threadCount) {
+            tours[i].solve(timeLimit * threadCount * tours[i].path.size() / total);
+          }
+        }));
+      }
+      for (int t = 0; t < threadCount; t++) {
+        workers[t].join();
+      }
+
+      fprintf(stderr,"cluster count = %d, thread count = %d\n", csize, threadCount);
+
+      vector< vector<int> > paths(ctx.shipCount);
+      vector<int> pos(ctx.shipCount);
+      vector<bool> assigned(csize, false);
+
+      for (int i = 0; i < ctx.shipCount; i++) {
+        pos[i] = getShip(i)->sid;
+      }
+
+      for (int k = 0; k < csize; k++) {
+        double minDist = DBL_MAX;
+        int shipId = -1;
+        int clusterId = -1;
+        bool reversed = false;
+
+        for (int c = 0; c < csize; c++) {
+          if (assigned[c]) continue;
+          int front = tours[c].path.front();
+          int back = tours[c].path.back();
+
+          for (int i = 0; i < ctx.shipCount; i++) {
+            double d1 = ctx.distTable[pos[i]][front];
+            double d2 = ctx.distTable[pos[i]][back];
+
+            if (minDist > min(d1, d2)) {
+              minDist = min(d1, d2);
+              shipId = i;
+              clusterId = c;
+              reversed = (d2 < d1);
+            }
+          }
         }
 
-        if (type == 1) {
-          newScore = goodScore - (subScore - (calcSubPathDist(c1) + calcSubPathDist(c2)));
-        } else {
-          newScore = calcPathDistMulti();
+        vector<int> &tour = tours[clusterId].path;
+        if (reversed) {
+          reverse(tour.begin(), tour.end());
         }
 
-        if (bestScore > newScore) {
-          bestScore = newScore;
+        paths[shipId].insert(paths[shipId].end(), tour.begin(), tour.end());
+        pos[shipId] = tour.back();
+        assigned[clusterId] = true;
+      }
+
+      return paths;
+    }
 
-          for (int i = 0; i < g_shipCount; i++) {
-            bestPaths[i] = g_shipList[i].path;
+    /*
+     * k-means over the stars, k grows until the mean distance to the center
+     * of every cluster fits in a galaxy.
+     */
+    vector< vector<int> > clusterStars(vector<int> &stars) {
+      int size = stars.size();
+      int maxK = min(MAX_GALAXY, size);
+      vector<int> label(size, 0);
+      vector<double> cy, cx;
+
+      for (int k = 1; k <= maxK; k++) {
+        cy.assign(k, 0.0);
+        cx.assign(k, 0.0);
+
+        // k-means++ seeding
+        vector<double> nearDist(size, DBL_MAX);
+        int first = stars[ctx.rng.nextInt(size)];
+        cy[0] = ctx.starY[first];
+        cx[0] = ctx.starX[first];
+
+        for (int c = 1; c < k; c++) {
+          double sum = 0.0;
+
+          for (int i = 0; i < size; i++) {
+            double dy = ctx.starY[stars[i]] - cy[c-1];
+            double dx = ctx.starX[stars[i]] - cx[c-1];
+            nearDist[i] = min(nearDist[i], dy*dy + dx*dx);
+            sum += nearDist[i];
           }
-        }
 
-        if (goodScore > newScore) {
-          goodScore = newScore;
-        } else {
-          switch (type) {
-            case 1:
-              swapStar(c1, c2, ship1->path);
+          double r = ctx.rng.nextDouble() * sum;
+          int index = size-1;
+
+          for (int i = 0; i < size; i++) {
+            r -= nearDist[i];
+            if (r <= 0.0) {
+              index = i;
               break;
-            default:
-              for (int i = 0; i < g_shipCount; i++) {
-                g_shipList[i].path = bestPaths[i];
+            }
+          }
+
+          cy[c] = ctx.starY[stars[index]];
+          cx[c] = ctx.starX[stars[index]];
+        }
+
+        vector<double> meanDist(k);
+
+        for (int iter = 0; iter < 20; iter++) {
+          bool changed = false;
+
+          for (int i = 0; i < size; i++) {
+            double minDist = DBL_MAX;
+            int best = 0;
+
+            for (int c = 0; c < k; c++) {
+              double dy = ctx.starY[stars[i]] - cy[c];
+              double dx = ctx.starX[stars[i]] - cx[c];
+              double dist = dy*dy + dx*dx;
+
+              if (minDist > dist) {
+                minDist = dist;
+                best = c;
               }
-            break;
+            }
+
+            if (label[i] != best) {
+              label[i] = best;
+              changed = true;
+            }
           }
+
+          vector<double> sy(k, 0.0), sx(k, 0.0);
+          vector<int> count(k, 0);
+
+          for (int i = 0; i < size; i++) {
+            sy[label[i]] += ctx.starY[stars[i]];
+            sx[label[i]] += ctx.starX[stars[i]];
+            count[label[i]]++;
+          }
+          for (int c = 0; c < k; c++) {
+            if (count[c] == 0) continue;
+            cy[c] = sy[c] / count[c];
+            cx[c] = sx[c] / count[c];
+          }
+
+          if (!changed && iter > 0) break;
         }
 
-        if (tryCount % 10 == 0) {
-          currentTime = getTime(startCycle);
+        vector<int> count(k, 0);
+        meanDist.assign(k, 0.0);
 
-          if (currentTime > timeLimit) {
-            break;
+        for (int i = 0; i < size; i++) {
+          int c = label[i];
+          meanDist[c] += calcDist(ctx.starY[stars[i]], ctx.starX[stars[i]], (int)cy[c], (int)cx[c]);
+          count[c]++;
+        }
+
+        bool fit = true;
+        for (int c = 0; c < k; c++) {
+          if (count[c] > 0 && meanDist[c] / count[c] > GALAXY_RADIUS) {
+            fit = false;
           }
         }
+
+        if (fit) break;
       }
 
-      for (int i = 0; i < g_shipCount; i++) {
-        Ship *ship = getShip(i);
-        ship->path = bestPaths[i];
+      vector< vector<int> > clusters(maxK);
+
+      for (int i = 0; i < size; i++) {
+        clusters[label[i]].push_back(stars[i]);
       }
 
-      fprintf(stderr,"tryCount = %lld, path size = %d, pathDist = %f\n",
-          tryCount, g_psize, bestScore + g_currentCost);
+      vector< vector<int> > result;
+      for (int c = 0; c < maxK; c++) {
+        if (!clusters[c].empty()) {
+          result.push_back(clusters[c]);
+        }
+      }
 
-      return bestPaths;
+      return result;
     }
 
     vector<int> TSPSolver(vector<int> stars, double timeLimit) {
-      g_path = stars;
-      g_psize = g_path.size();
-      vector<int> bestPath = g_path;
-      vector<int> goodPath = g_path;
+      ctx.path = stars;
+      ctx.psize = ctx.path.size();
+      vector<int> bestPath = ctx.path;
       int c1, c2;
 
-      if (g_psize <= 2) {
+      if (ctx.psize <= 1) {
         return bestPath;
       }
 
       double bestScore = calcPathDist();
       double goodScore = bestScore;
-      double subScore, newScore;
+      double subScore = 0.0, newScore = 0.0;
 
-      ll startCycle = getCycle();
-      double currentTime;
+      Annealer annealer(timeLimit);
+      MoveSelector &selector = ctx.tspMoves;
+      selector.restart();
+      vector<double> deltas;
       ll tryCount = 0;
-
-      double T = 10000.0;
-      double k = 1.0;
-      double alpha = 0.999;
       int type;
 
+      for (int i = 0; i < 1000; i++) {
+        do {
+          c1 = ctx.rng.nextInt(ctx.psize);
+          c2 = ctx.rng.nextInt(ctx.psize);
+        } while (c1 == c2);
+
+        subScore = calcSubPathDist(c1) + calcSubPathDist(c2);
+        reconnectPath(c1, c2, ctx.path);
+        deltas.push_back(calcSubPathDist(c1) + calcSubPathDist(c2) - subScore);
+        reconnectPath(c1, c2, ctx.path);
+      }
+      annealer.calibrate(deltas);
+
       while(1) {
+        ll moveStart = getCycle();
+
         do {
-          c1 = xor128() % g_psize;
-          c2 = xor128() % g_psize;
+          c1 = ctx.rng.nextInt(ctx.psize);
+          c2 = ctx.rng.nextInt(ctx.psize);
         } while (c1 == c2);
 
-        type = xor128()&3;
+        type = selector.next(ctx.rng);
 
-        if (type == 3 && (c1 > g_psize-3 || c2 > g_psize-3)) {
+        if (type == 3 && (c1 > ctx.psize-3 || c2 > ctx.psize-3)) {
+          selector.reject(type, getCycle() - moveStart);
           continue;
         }
 
@@ -801,65 +3083,315 @@ class StarTraveller {
         switch(type) {
           case 0:
             subScore = calcSubPathDist(c1) + calcSubPathDist(c2);
-            reconnectPath(c1, c2, g_path);
+            reconnectPath(c1, c2, ctx.path);
             break;
           case 1:
             subScore = calcSubPathDist(c1) + calcSubPathDist(c2);
-            swapStar(c1, c2, g_path);
+            swapStar(c1, c2, ctx.path);
             break;
           case 2:
-            insertStar(c1, c2, g_path);
+            newScore = goodScore + insertStarDelta(c1, c2, 1);
+            insertStar(c1, c2, ctx.path);
             break;
           case 3:
+            newScore = goodScore + insertStarDelta(c1, c2, 2);
             insertStar2(c1, c2);
             break;
         }
 
         if (type <= 1) {
           newScore = goodScore - (subScore - (calcSubPathDist(c1) + calcSubPathDist(c2)));
-        } else {
-          newScore = calcPathDist();
         }
 
-        double scoreDiff = goodScore - newScore;
-
         if (bestScore > newScore) {
           bestScore = newScore;
-          bestPath = g_path;
+          bestPath = ctx.path;
         }
 
-        if (goodScore > newScore) {
-          goodScore = newScore;
-        } else if (xor128()%100 < 100*exp(scoreDiff/(k*T))) {
+        double delta = newScore - goodScore;
+        bool accepted = annealer.accept(delta, ctx.rng);
+
+        if (accepted) {
           goodScore = newScore;
         } else {
           switch (type) {
             case 0:
-              reconnectPath(c1, c2, g_path);
+              reconnectPath(c1, c2, ctx.path);
               break;
             case 1:
-              swapStar(c1, c2, g_path);
+              swapStar(c1, c2, ctx.path);
               break;
-            default:
-              g_path = bestPath;
+            case 2:
+              insertStar(c2, c1, ctx.path);
               break;
-          } 
+            case 3:
+              insertStar2(c2, c1);
+              break;
+          }
         }
 
-        if (tryCount % 10 == 0) {
-          currentTime = getTime(startCycle);
+        selector.record(type, delta, accepted, getCycle() - moveStart);
 
-          if (currentTime > timeLimit) {
-            break;
+        if (tryCount % 10 == 0 && !annealer.update()) {
+          break;
+        }
+      }
+
+      fprintf(stderr,"path size = %d, pathDist = %f\n", ctx.psize, bestScore + ctx.currentCost);
+
+      return bestPath;
+    }
+
+    void setupNearList(vector<int> &stars) {
+      int size = stars.size();
+      vector< pair<double, int> > cand(size);
+      vector<bool> member(ctx.starCount, false);
+
+      ctx.nearSize = min(NEAR_SIZE, size-1);
+
+      for (int i = 0; i < size; i++) {
+        member[stars[i]] = true;
+      }
+
+      for (int i = 0; i < size; i++) {
+        int sid = stars[i];
+
+        // the cached near stars of the whole instance that are still left, if enough are
+        if (ctx.cache.nearList != NULL) {
+          int found = 0;
+
+          for (int k = 0; k < ctx.cache.nearCount && found < ctx.nearSize; k++) {
+            int nid = ctx.cache.nearList[sid][k];
+            if (member[nid]) ctx.nearList[sid][found++] = nid;
           }
+
+          if (found == ctx.nearSize) continue;
+        }
+
+        for (int j = 0; j < size; j++) {
+          double dist = (i == j)? DBL_MAX : ctx.distTable[sid][stars[j]];
+          cand[j] = make_pair(dist, stars[j]);
         }
 
-        T *= alpha;
+        partial_sort(cand.begin(), cand.begin()+ctx.nearSize, cand.end());
+
+        for (int k = 0; k < ctx.nearSize; k++) {
+          ctx.nearList[sid][k] = cand[k].second;
+        }
       }
+    }
 
-      fprintf(stderr,"path size = %d, pathDist = %f\n", g_psize, bestScore + g_currentCost);
+    // positions are indices into the giant tour buffer
+    void updateRouteIndex(int r1, int r2) {
+      GiantTour &g = ctx.giant;
 
-      return bestPath;
+      if (r1 > r2) swap(r1, r2);
+
+      for (int r = r1; r <= r2; r++) {
+        for (int p = g.start[r]; p < g.start[r+1]; p++) {
+          ctx.routeOf[g.tour[p]] = r;
+          ctx.posOf[g.tour[p]] = p;
+        }
+      }
+    }
+
+    // in front of the route is the ship itself, past its end there is no star (-1)
+    int routeStar(int r, int p) {
+      GiantTour &g = ctx.giant;
+
+      if (p < g.start[r]) return getShip(r)->sid;
+      if (p >= g.start[r+1]) return -1;
+      return g.tour[p];
+    }
+
+    double routeDist(int r) {
+      GiantTour &g = ctx.giant;
+      double dist = 0.0;
+      int sid = getShip(r)->sid;
+
+      for (int p = g.start[r]; p < g.start[r+1]; p++) {
+        dist += ctx.distTable[sid][g.tour[p]];
+        sid = g.tour[p];
+      }
+
+      return dist;
+    }
+
+    // penalty of a route with the given number of stars
+    double overflowCost(int size) {
+      return OVERFLOW_COST * max(0, size - ctx.routeLimit);
+    }
+
+    double overflowDelta(int s1, int d1, int s2, int d2) {
+      GiantTour &g = ctx.giant;
+      int size1 = g.size(s1);
+      int size2 = g.size(s2);
+
+      return overflowCost(size1 + d1) - overflowCost(size1) + overflowCost(size2 + d2) - overflowCost(size2);
+    }
+
+    /*
+     * a last resort after the annealing: while a ship has more stars than turns
+     * left, its star that is cheapest to move goes to its cheapest place on a ship
+     * with room.
+     */
+    void repairRoutes() {
+      int limit = ctx.routeLimit;
+      int moved = 0;
+
+      for (int r = 0; r < ctx.shipCount; r++) {
+        vector<int> &path = getShip(r)->path;
+
+        while ((int)path.size() > limit) {
+          double minCost = DBL_MAX;
+          int from = -1, to = -1, pos = -1;
+
+          for (int p = 0; p < (int)path.size(); p++) {
+            int prev = (p == 0)? getShip(r)->sid : path[p-1];
+            int next = (p+1 < (int)path.size())? path[p+1] : -1;
+            int sid = path[p];
+            double saving = ctx.distTable[prev][sid] + edgeDist(sid, next) - edgeDist(prev, next);
+
+            for (int q = 0; q < ctx.shipCount; q++) {
+              vector<int> &other = getShip(q)->path;
+              if (q == r || (int)other.size() >= limit) continue;
+
+              for (int t = 0; t <= (int)other.size(); t++) {
+                int before = (t == 0)? getShip(q)->sid : other[t-1];
+                int after = (t < (int)other.size())? other[t] : -1;
+                double cost = ctx.distTable[before][sid] + edgeDist(sid, after) - edgeDist(before, after) - saving;
+
+                if (minCost > cost) {
+                  minCost = cost;
+                  from = p;
+                  to = q;
+                  pos = t;
+                }
+              }
+            }
+          }
+
+          // no ship has room, the turns cannot cover all stars anyway
+          if (to < 0) return;
+
+          vector<int> &other = getShip(to)->path;
+          other.insert(other.begin() + pos, path[from]);
+          path.erase(path.begin() + from);
+          moved++;
+        }
+      }
+
+      if (moved > 0) {
+        fprintf(stderr,"repaired routes, moved %d stars, limit %d\n", moved, limit);
+      }
+    }
+
+    double edgeDist(int from, int to) {
+      return (from < 0 || to < 0)? 0.0 : ctx.distTable[from][to];
+    }
+
+    // samples neighbor move deltas of the current paths without applying them
+    void calibrateMulti(Annealer &annealer) {
+      GiantTour &g = ctx.giant;
+      vector<double> deltas;
+      if (ctx.nearSize == 0) return;
+
+      for (int k = 0; k < 1000; k++) {
+        int s1 = ctx.rng.nextInt(ctx.shipCount);
+        int size1 = g.size(s1);
+        if (size1 == 0) continue;
+
+        int a = g.tour[g.start[s1] + ctx.rng.nextInt(size1)];
+        int c = ctx.nearList[a][ctx.rng.nextInt(ctx.nearSize)];
+        if (ctx.routeOf[c] == s1) continue;
+        // the overflow penalty would swamp the temperature
+        if (g.size(ctx.routeOf[c]) >= ctx.routeLimit) continue;
+
+        double delta = 0.0;
+        if (exchangeSegment(a, c, 1, 0, -DBL_MAX, delta)) continue;
+        deltas.push_back(delta);
+      }
+
+      annealer.calibrate(deltas);
+    }
+
+    /*
+     * moves the segment of length l1 starting at star a right behind its near star c
+     * on another ship, the l2 stars that followed c go to the old place of the segment.
+     * l2 = 0 is a relocate chain, l2 > 0 a cross exchange. applied when its delta is
+     * below the threshold.
+     */
+    bool exchangeSegment(int a, int c, int l1, int l2, double threshold, double &delta) {
+      GiantTour &g = ctx.giant;
+      int s1 = ctx.routeOf[a];
+      int s2 = ctx.routeOf[c];
+      int i = ctx.posOf[a];
+      int j = ctx.posOf[c];
+
+      if (i+l1 > g.start[s1+1] || j+1+l2 > g.start[s2+1]) return false;
+
+      int pa = routeStar(s1, i-1);
+      int ea = g.tour[i+l1-1];
+      int na = routeStar(s1, i+l1);
+      int nc = routeStar(s2, j+l2+1);
+
+      if (l2 == 0) {
+        delta = edgeDist(pa, na) + ctx.distTable[c][a] + edgeDist(ea, nc)
+          - ctx.distTable[pa][a] - edgeDist(ea, na) - edgeDist(c, nc);
+      } else {
+        int fc = g.tour[j+1];
+        int ec = g.tour[j+l2];
+
+        delta = ctx.distTable[pa][fc] + edgeDist(ec, na) + ctx.distTable[c][a] + edgeDist(ea, nc)
+          - ctx.distTable[pa][a] - edgeDist(ea, na) - ctx.distTable[c][fc] - edgeDist(ec, nc);
+      }
+
+      delta += overflowDelta(s1, l2 - l1, s2, l1 - l2);
+
+      if (delta >= threshold) return false;
+
+      if (s1 < s2) {
+        g.swapBlocks(s1, i, i+l1, s2, j+1, j+1+l2);
+      } else {
+        g.swapBlocks(s2, j+1, j+1+l2, s1, i, i+l1);
+      }
+
+      updateRouteIndex(s1, s2);
+
+      return true;
+    }
+
+    /*
+     * 2-opt* : exchanges the tails of two ships so that star a is followed by its
+     * near star c. applied when its delta is below the threshold.
+     */
+    bool twoOptStar(int a, int c, double threshold, double &delta) {
+      GiantTour &g = ctx.giant;
+      int s1 = ctx.routeOf[a];
+      int s2 = ctx.routeOf[c];
+      int i = ctx.posOf[a];
+      int j = ctx.posOf[c];
+
+      int na = routeStar(s1, i+1);
+      int pc = routeStar(s2, j-1);
+
+      delta = ctx.distTable[a][c] + edgeDist(pc, na) - edgeDist(a, na) - ctx.distTable[pc][c];
+
+      int tail1 = g.start[s1+1] - (i+1);
+      int tail2 = g.start[s2+1] - j;
+      delta += overflowDelta(s1, tail2 - tail1, s2, tail1 - tail2);
+
+      if (delta >= threshold) return false;
+
+      if (s1 < s2) {
+        g.swapBlocks(s1, i+1, g.start[s1+1], s2, j, g.start[s2+1]);
+      } else {
+        g.swapBlocks(s2, j, g.start[s2+1], s1, i+1, g.start[s1+1]);
+      }
+
+      updateRouteIndex(s1, s2);
+
+      return true;
     }
 
     void swapStar(int c1, int c2, vector<int> &path) {
@@ -869,153 +3401,135 @@ class StarTraveller {
     }
 
     void insertStar(int c1, int c2, vector<int> &path) {
-      int temp = g_path[c1];
-
-      path.erase(path.begin()+c1);
-      path.insert(path.begin()+c2, temp);
-    }
-
-    void insertStarMS(vector<int> &path) {
-      int c1, c2;
-      int size = path.size();
-      do {
-        c1 = xor128() % size;
-        c2 = xor128() % size;
-      } while (c1 == c2);
+      int temp = ctx.path[c1];
 
-      int temp = path[c1];
       path.erase(path.begin()+c1);
       path.insert(path.begin()+c2, temp);
     }
 
-    void insertStarMulti(Ship *ship1, Ship *ship2) {
-      int size1 = ship1->path.size();
-      int size2 = ship2->path.size();
+    // moves a star of ship1 to a random place on ship2
+    void insertStarMulti(int s1, int s2) {
+      GiantTour &g = ctx.giant;
+      int size1 = g.size(s1);
+      int size2 = g.size(s2);
 
-      int c1 = xor128() % size1;
-      int c2 = (size2 == 0)? 0 : xor128() % size2;
+      int c1 = ctx.rng.nextInt(size1);
+      int c2 = (size2 == 0)? 0 : ctx.rng.nextInt(size2);
+      int a = g.start[s1] + c1;
 
-      int temp = ship1->path[c1];
-
-      ship1->path.erase(ship1->path.begin()+c1);
-      ship2->path.insert(ship2->path.begin()+c2, temp);
+      g.moveBlock(s1, a, a+1, s2, g.start[s2] + c2);
     }
 
-    void insertStarMulti2(Ship *ship1, Ship *ship2) {
-      int size1 = ship1->path.size();
-      int size2 = ship2->path.size();
+    // moves two stars of ship1 to ship2, they land in reverse order
+    bool insertStarMulti2(int s1, int s2) {
+      GiantTour &g = ctx.giant;
+      int size1 = g.size(s1);
+      int size2 = g.size(s2);
 
-      int c1 = (size1 == 0)? 0 : xor128() % size1;
-      int c2 = (size2 == 0)? 0 : xor128() % size2;
+      int c1 = (size1 == 0)? 0 : ctx.rng.nextInt(size1);
+      int c2 = (size2 == 0)? 0 : ctx.rng.nextInt(size2);
 
       if (c1 > size1-3 || c2 > size2-3) {
-        return;
+        return false;
       }
 
-      int temp = ship1->path[c1];
-      int temp2 = ship1->path[c1+1];
+      int a = g.start[s1] + c1;
 
-      ship1->path.erase(ship1->path.begin()+c1);
-      ship1->path.erase(ship1->path.begin()+c1);
-      ship2->path.insert(ship2->path.begin()+c2, temp);
-      ship2->path.insert(ship2->path.begin()+c2, temp2);
-    }
+      swap(g.tour[a], g.tour[a+1]);
+      g.moveBlock(s1, a, a+2, s2, g.start[s2] + c2);
 
-    void reversePath(Ship *ship1) {
-      reverse(ship1->path.begin(), ship1->path.end());
+      return true;
     }
 
-    void cutPath(Ship *ship1, Ship *ship2) {
-      int size1 = ship1->path.size();
+    void insertStarMS(int s1) {
+      GiantTour &g = ctx.giant;
+      StarIndex *route = g.tour + g.start[s1];
+      int size = g.size(s1);
+      int c1, c2;
 
-      vector<int> path = ship1->path;
-      int c1 = xor128() % size1;
-      ship1->path.clear();
+      do {
+        c1 = ctx.rng.nextInt(size);
+        c2 = ctx.rng.nextInt(size);
+      } while (c1 == c2);
 
-      for (int i = 0; i < size1; i++) {
-        if (i < c1) {
-          ship1->path.push_back(path[i]);
-        } else {
-          ship2->path.push_back(path[i]);
-        }
+      if (c1 < c2) {
+        rotate(route+c1, route+c1+1, route+c2+1);
+      } else {
+        rotate(route+c2, route+c1, route+c1+1);
       }
     }
 
-    void cutPathReverse(Ship *ship1, Ship *ship2) {
-      int size1 = ship1->path.size();
-      int size2 = ship2->path.size();
+    // hands the tail of ship1 over to the end of ship2
+    void cutPath(int s1, int s2) {
+      GiantTour &g = ctx.giant;
+      int c1 = ctx.rng.nextInt(g.size(s1));
 
-      vector<int> path = ship1->path;
-      int c1 = (size1 == 0)? 0 : xor128() % size1;
-      ship1->path.clear();
-      int type = xor128()%2;
+      g.moveBlock(s1, g.start[s1] + c1, g.start[s1+1], s2, g.start[s2+1]);
+    }
 
-      for (int i = 0; i < size1; i++) {
-        if (i < c1) {
-          ship1->path.push_back(path[i]);
-        } else {
-          if (type == 0) {
-            ship2->path.insert(ship2->path.begin()+size2, path[i]);
-          } else {
-            ship2->path.insert(ship2->path.begin(), path[i]);
-          }
-        }
+    // hands the tail of ship1 over to the end of ship2, or reversed to its front
+    void cutPathReverse(int s1, int s2) {
+      GiantTour &g = ctx.giant;
+      int size1 = g.size(s1);
+      int c1 = (size1 == 0)? 0 : ctx.rng.nextInt(size1);
+      int type = ctx.rng.nextInt(2);
+      int a = g.start[s1] + c1;
+      int b = g.start[s1+1];
+
+      if (type == 0) {
+        g.moveBlock(s1, a, b, s2, g.start[s2+1]);
+      } else {
+        reverse(g.tour+a, g.tour+b);
+        g.moveBlock(s1, a, b, s2, g.start[s2]);
       }
     }
 
-    void cleanPathSingle(int shipId) {
-      double minDist = DBL_MAX;
-      int index = -1;
-      Ship *ship = getShip(shipId);
-      int size = ship->path.size();
+    // cuts a cycle into the open path from the anchor that saves the most
+    void anchorPath(vector<int> &path) {
+      int size = path.size();
+
+      if (size <= 1 || ctx.anchor < 0) return;
 
-      if (size <= 1) return;
+      double minDiff = DBL_MAX;
+      int index = -1;
+      bool forward = true;
 
       for (int i = 0; i < size; i++) {
-        int sid = ship->path[i];
+        int sid = path[i];
+        int bid = path[(i+size-1)%size];
+        int aid = path[(i+1)%size];
+        double d = ctx.distTable[ctx.anchor][sid];
 
-        double dist = DIST_TABLE[ship->sid][sid];
-        
-        if (minDist > dist) {
-          minDist = dist;
+        if (minDiff > d - ctx.distTable[bid][sid]) {
+          minDiff = d - ctx.distTable[bid][sid];
+          index = i;
+          forward = true;
+        }
+        if (minDiff > d - ctx.distTable[sid][aid]) {
+          minDiff = d - ctx.distTable[sid][aid];
           index = i;
+          forward = false;
         }
       }
 
-      int bid = (index == 0)? size-1 : index-1;
-      int aid = (index+1)%size;
-
-      double d1 = DIST_TABLE[ship->path[bid]][ship->path[index]];
-      double d2 = DIST_TABLE[ship->path[index]][ship->path[aid]];
-      vector<int> npath;
-
-      if (d1 > d2) {
-        for (int i = 0; i < size; i++) {
-          npath.push_back(ship->path[(index+i)%size]);
-        }
-      } else {
-        for (int i = 0; i < size; i++) {
-          int j = index-i;
+      vector<int> npath(size);
 
-          if (j < 0) {
-            npath.push_back(ship->path[size+j]);
-          } else {
-            npath.push_back(ship->path[j]);
-          }
-        }
+      for (int i = 0; i < size; i++) {
+        int j = (forward)? index+i : index-i+size;
+        npath[i] = path[j%size];
       }
 
-      ship->path = npath;
+      path = npath;
     }
 
     void insertStar2(int c1, int c2) {
-      int temp = g_path[c1];
-      int temp2 = g_path[c1+1];
+      int temp = ctx.path[c1];
+      int temp2 = ctx.path[c1+1];
 
-      g_path.erase(g_path.begin()+c1);
-      g_path.erase(g_path.begin()+c1);
-      g_path.insert(g_path.begin()+c2, temp);
-      g_path.insert(g_path.begin()+c2, temp2);
+      ctx.path.erase(ctx.path.begin()+c1);
+      ctx.path.erase(ctx.path.begin()+c1);
+      ctx.path.insert(ctx.path.begin()+c2, temp);
+      ctx.path.insert(ctx.path.begin()+c2, temp2);
     }
 
     void reconnectPath(int c1, int c3, vector<int> &path) {
@@ -1037,23 +3551,45 @@ class StarTraveller {
       }
     }
 
+    /*
+     * delta of insertStar (len 1) or insertStar2 (len 2, the pair lands reversed)
+     * on the open path from the anchor, c2 indexes the path without the moved stars.
+     */
+    double insertStarDelta(int c1, int c2, int len) {
+      vector<int> &path = ctx.path;
+      int size = ctx.psize;
+      int x = path[c1];
+      int y = path[c1+len-1];
+      int p = (c1 == 0)? ctx.anchor : path[c1-1];
+      int n = (c1+len < size)? path[c1+len] : -1;
+      int q = (c2 == 0)? ctx.anchor : path[(c2-1 < c1)? c2-1 : c2-1+len];
+      int r = (c2 < size-len)? path[(c2 < c1)? c2 : c2+len] : -1;
+
+      double removeGain = edgeDist(p, x) + edgeDist(y, n) - edgeDist(p, n);
+      double insertCost = edgeDist(q, y) + edgeDist(x, r) - edgeDist(q, r);
+
+      return insertCost - removeGain;
+    }
+
     double calcSubPathDist(int index) {
-      int bid = (index == 0)? g_psize-1 : index-1;
-      int aid = (index+1)%g_psize;
+      int bid = (index == 0)? ctx.anchor : ctx.path[index-1];
+      int aid = (index == ctx.psize-1)? -1 : ctx.path[index+1];
 
-      double d1 = DIST_TABLE[g_path[bid]][g_path[index]];
-      double d2 = DIST_TABLE[g_path[index]][g_path[aid]];
+      double d1 = edgeDist(bid, ctx.path[index]);
+      double d2 = edgeDist(ctx.path[index], aid);
 
       return (d1+d2);
     }
 
     double calcPathDist() {
-      double totalDist = 0;
+      if (ctx.psize == 0) return 0.0;
+
+      double totalDist = edgeDist(ctx.anchor, ctx.path[0]);
 
-      for (int i = 0; i < g_psize; i++) {
-        int s1 = g_path[i];
-        int s2 = g_path[(i+1)%g_psize];
-        double dist = DIST_TABLE[s1][s2];
+      for (int i = 0; i < ctx.psize-1; i++) {
+        int s1 = ctx.path[i];
+        int s2 = ctx.path[i+1];
+        double dist = ctx.distTable[s1][s2];
 
         totalDist += dist;
       }
@@ -1061,12 +3597,12 @@ class StarTraveller {
       return totalDist;
     }
 
-    bool existAroundStar(int sid) {
-      for (int i = 0; i < g_starCount; i++) {
-        Star *star = getStar(i);
-        if (star->visited) continue;
+    // an unvisited star nearby whose coverage is below the limit
+    bool existAroundStar(int sid, double limit) {
+      for (int i = 0; i < ctx.starCount; i++) {
+        if (isVisited(i)) continue;
 
-        if (DIST_TABLE[sid][i] <= 40.0) {
+        if (ctx.distTable[sid][i] <= ctx.params.aroundStarDist && (limit >= 1.0 || coverage(i) < limit)) {
           return true;
         }
       }
@@ -1074,11 +3610,28 @@ class StarTraveller {
       return false;
     }
 
+    /*
+     * probability that some UFO lands on the star before the endgame, which starts
+     * at the earliest at turn 3 * starCount and at the latest when it is forced.
+     * the landing rate seen so far is shrunk toward an even share of all landings,
+     * the prior counts as coverPrior turns of observation.
+     */
+    double coverage(int sid) {
+      if (ctx.ufoLandings == 0) return 0.0;
+
+      double prior = ctx.params.coverPrior;
+      double evenRate = (double)ctx.ufoLandings / ctx.turn / ctx.starCount;
+      double rate = (ctx.ufoVisits[sid] + prior * evenRate) / (ctx.turn + prior);
+      int turnsLeft = max(0, min(3*ctx.starCount - ctx.turn, ctx.timeLimit - ctx.remainCount));
+
+      return 1.0 - exp(-rate * turnsLeft);
+    }
+
     bool existAroundShip(int sid) {
-      for (int i = 0; i < g_shipCount; i++) {
+      for (int i = 0; i < ctx.shipCount; i++) {
         Ship *ship = getShip(i);
 
-        if (ship->uid < 0 && DIST_TABLE[sid][ship->sid] <= 120) {
+        if (ship->uid < 0 && ctx.distTable[sid][ship->sid] <= ctx.params.aroundShipDist) {
           return false;
         }
       }
@@ -1089,19 +3642,8 @@ class StarTraveller {
     double calcPathDistMulti() {
       double totalDist = 0.0;
 
-      for (int i = 0; i < g_shipCount; i++) {
-        Ship *ship = getShip(i);
-
-        int size = ship->path.size();
-        int sid = ship->sid;
-
-        for (int j = 0; j < size; j++) {
-          int nid = ship->path[j];
-          double dist = DIST_TABLE[sid][nid];
-
-          totalDist += dist;
-          sid = nid;
-        }
+      for (int i = 0; i < ctx.shipCount; i++) {
+        totalDist += routeDist(i);
       }
 
       return totalDist;
@@ -1109,14 +3651,16 @@ class StarTraveller {
 
     vector<int> getOutput() {
       vector<int> ret;
+      vector<int> arrived;
+      double turnCost = ctx.currentCost;
 
-      for (int i = 0; i < g_shipCount; i++) {
+      for (int i = 0; i < ctx.shipCount; i++) {
         Ship *ship = getShip(i);
-        ret.push_back(ship->nid);
+        ret.push_back(ctx.toExternal[ship->nid]);
 
-        double dist = DIST_TABLE[ship->sid][ship->nid];
+        double dist = ctx.distTable[ship->sid][ship->nid];
 
-        for (int j = 0; j < g_ufoCount; j++) {
+        for (int j = 0; j < ctx.ufoCount; j++) {
           UFO *ufo = getUFO(j);
 
           if (ufo->sid == ship->sid && ufo->nid == ship->nid) {
@@ -1124,23 +3668,74 @@ class StarTraveller {
           }
         }
 
+        int type = (ship->sid == ship->nid)? MOVE_STAY : ship->move;
+
+        ctx.energy[i][type] += dist;
+        if (!isVisited(ship->nid) && find(arrived.begin(), arrived.end(), ship->nid) == arrived.end()) {
+          ctx.newStars[i][type]++;
+          arrived.push_back(ship->nid);
+        }
+
         ship->sid = ship->nid;
-        g_currentCost += dist;
+        ctx.currentCost += dist;
+      }
+
+      ctx.lastTurnCost = ctx.currentCost - turnCost;
+
+      // the game ends when every star is visited or the turns run out
+      if (!ctx.reported && (ctx.remainCount == (int)arrived.size() || ctx.timeLimit == 0)) {
+        showEnergyReport();
+        ctx.reported = true;
       }
 
       return ret;
     }
 
-    Star *getStar(int id) {
-      return &g_starList[id];
+    /*
+     * where the energy went, totals per move type as "key = value" lines for
+     * scripts/analyze.rb and one line per ship.
+     */
+    void showEnergyReport() {
+      for (int t = 0; t < MOVE_TYPE_COUNT; t++) {
+        double energy = 0.0;
+        int count = 0;
+
+        for (int i = 0; i < ctx.shipCount; i++) {
+          energy += ctx.energy[i][t];
+          count += ctx.newStars[i][t];
+        }
+
+        fprintf(stderr,"energy_%s = %f\n", MOVE_TYPE_NAME[t], energy);
+        fprintf(stderr,"stars_%s = %d\n", MOVE_TYPE_NAME[t], count);
+      }
+
+      for (int i = 0; i < ctx.shipCount; i++) {
+        fprintf(stderr,"ship %d:", i);
+        for (int t = 0; t < MOVE_TYPE_COUNT; t++) {
+          fprintf(stderr," %s %.1f/%d", MOVE_TYPE_NAME[t], ctx.energy[i][t], ctx.newStars[i][t]);
+        }
+        fprintf(stderr,"\n");
+      }
+
+      RouteEngine &router = ctx.router;
+      fprintf(stderr,"route engine: %lld builds, %f us per build, %d capped\n", router.builds,
+          (router.builds > 0)? router.cycles / (CYCLE_PER_SEC / 1e6) / router.builds : 0.0, router.capped);
+    }
+
+    bool isVisited(int id) {
+      return (ctx.visited[id >> 6] >> (id & 63)) & 1;
+    }
+
+    void setVisited(int id) {
+      ctx.visited[id >> 6] |= 1ULL << (id & 63);
     }
 
     Ship *getShip(int id) {
-      return &g_shipList[id];
+      return &ctx.shipList[id];
     }
 
     UFO *getUFO(int id) {
-      return &g_ufoList[id];
+      return &ctx.ufoList[id];
     }
 
     void showPath(vector<int> &path) {
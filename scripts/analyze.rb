@@ -1,5 +1,8 @@
 class Analyze
-  TSV_LABEL = ['seed', 'score', 'time'].join("\t")
+  MOVE_TYPES = ['boarding', 'rideoff', 'transfer', 'ride', 'stationary', 'endgame']
+  ENERGY_KEYS = MOVE_TYPES.flat_map { |type| ["energy_#{type}", "stars_#{type}"] }
+  QUALITY_KEYS = ['endgame_bound', 'endgame_gap']
+  TSV_LABEL = (['seed', 'score', 'time'] + ENERGY_KEYS + QUALITY_KEYS).join("\t")
 
   def initialize
     data_list = parse
@@ -11,6 +14,7 @@ class Analyze
       @record.puts(TSV_LABEL)
 
       sum_score = 0.0
+      sum_energy = Hash.new(0.0)
       seeds = []
 
       data_list.each do |data|
@@ -19,11 +23,13 @@ class Analyze
         seeds << data[0]
         puts data[1]
         sum_score += data[1]
+        ENERGY_KEYS.each_with_index { |key, i| sum_energy[key] += data[3+i] }
         @record.puts(data.join("\t"))
       end
 
       #p seeds
       puts sum_score
+      ENERGY_KEYS.each { |key| puts "#{key} = #{sum_energy[key]}" }
     ensure
       @record&.close
     end
@@ -35,7 +41,8 @@ class Analyze
     /(?<minute>\d+)m(?<second>(\d|\.)+)s/ =~ data['user']
     time = minute.to_f * 60 + second.to_f
 
-    [seed, score, time]
+    # runs without a lower bound leave the quality columns empty
+    [seed, score, time] + ENERGY_KEYS.map { |key| data[key].to_f } + QUALITY_KEYS.map { |key| data[key]&.to_f }
   end
 
   def parse
@@ -79,7 +86,7 @@ class Analyze
   end
 
   def validate(line)
-    line =~ /^(score|seed|user)/
+    line =~ /^(score|seed|user|energy_|stars_|endgame_)/
   end
 
   def validate2(line)
@@ -0,0 +1,216 @@
+require 'open3'
+require 'etc'
+require 'thread'
+
+# tunes the Params of StarTraveller per instance class by racing
+#   ruby scripts/tune.rb <first seed> <last seed>
+# the table is written to params/tuned.txt, run with STAR_PARAMS=params/tuned.txt
+class Tune
+  # name => [default, min, max]
+  PARAMS = {
+    'rideLineSolo'      => [756, 0, 1024],
+    'rideLineEarly'     => [64, 0, 512],
+    'rideLineEarlyMany' => [32, 0, 512],
+    'rideLineFull'      => [16, 0, 256],
+    'rideLineFullMany'  => [0, 0, 256],
+    'rideLineLate'      => [256, 0, 1024],
+    'aroundStarDist'    => [40.0, 0.0, 200.0],
+    'aroundShipDist'    => [120.0, 0.0, 400.0],
+    'transferDist'      => [10.0, 0.0, 50.0],
+    'firstSolveTime'    => [2.5, 0.5, 5.0],
+    'solveRatio'        => [0.9, 0.5, 0.95],
+    'retrySingle'       => [10, 1, 40],
+    'retryMulti'        => [20, 1, 40],
+    'coverPrior'        => [100.0, 10.0, 1000.0],
+    'coverLimit'        => [1.0, 0.5, 1.0],
+    'coverValue'        => [2.0, 0.0, 8.0],
+    'switchShips'       => [1.0, 1.0, 4.0],
+  }
+  INT_PARAMS = ['rideLineSolo', 'rideLineEarly', 'rideLineEarlyMany', 'rideLineFull',
+                'rideLineFullMany', 'rideLineLate', 'retrySingle', 'retryMulti']
+
+  CANDIDATES = (ENV['TUNE_CANDIDATES'] || 12).to_i
+  BATCH = (ENV['TUNE_BATCH'] || 10).to_i
+  # no config is dropped before it has run this many seeds
+  MIN_SEEDS = (ENV['TUNE_MIN_SEEDS'] || 10).to_i
+  # the solver is timed, too many jobs at once make every run worse
+  JOBS = (ENV['TUNE_JOBS'] || [1, Etc.nprocessors / 2].max).to_i
+  RUNNER = ENV['TUNE_RUNNER'] || "java -jar visualizer.jar -seed %d -novis -exec './StarTraveller'"
+  DIR = 'params'
+
+  def initialize(seeds)
+    Dir.mkdir(DIR) unless Dir.exist?(DIR)
+    @default = Hash[PARAMS.map { |name, range| [name, range[0]] }]
+
+    classes, baseline = classify(seeds)
+    table = {}
+
+    classes.sort.each do |klass, class_seeds|
+      puts "class #{klass}: #{class_seeds.size} seeds"
+      # too few seeds to tell configs apart, the class keeps the defaults
+      next if class_seeds.size < MIN_SEEDS
+
+      table[klass] = race(klass, class_seeds, baseline)
+    end
+
+    write_table(table)
+  end
+
+  # runs every seed once with the defaults, the solver prints its instance class
+  def classify(seeds)
+    path = write_config('default', @default)
+    results = evaluate(seeds.map { |seed| [path, seed] })
+    classes = Hash.new { |h, k| h[k] = [] }
+    baseline = {}
+
+    seeds.each do |seed|
+      score, klass = results[[path, seed]]
+      next if klass.nil?
+
+      classes[klass] << seed
+      baseline[seed] = score
+    end
+
+    [classes, baseline]
+  end
+
+  def race(klass, seeds, baseline)
+    configs = [@default] + Array.new(CANDIDATES-1) { mutate(@default) }
+    paths = configs.each_with_index.map { |config, i| write_config("#{klass.tr(' ', '_')}-#{i}", config) }
+    scores = Array.new(configs.size) { {} }
+    alive = (0...configs.size).to_a
+    done = []
+
+    seeds.each { |seed| scores[0][seed] = baseline[seed] }
+
+    seeds.each_slice(BATCH) do |batch|
+      jobs = alive.product(batch).reject { |c, seed| scores[c].key?(seed) }
+      results = evaluate(jobs.map { |c, seed| [paths[c], seed] })
+
+      jobs.each { |c, seed| scores[c][seed] = results[[paths[c], seed]][0] }
+      done += batch
+
+      alive = drop_worse(alive, scores, done) if done.size >= MIN_SEEDS
+      puts "  #{done.size} seeds, #{alive.size} configs left"
+      break if alive.size == 1
+    end
+
+    rel = relative_scores(alive, scores, done)
+    best = alive.max_by { |c| mean(rel[c]) }
+    puts "  best config #{best}, relative score #{mean(rel[best])} (default #{rel[0] ? mean(rel[0]) : 'dropped'})"
+
+    configs[best]
+  end
+
+  # topcoder style: the best energy on a seed divided by the energy of the config
+  def relative_scores(alive, scores, seeds)
+    rel = {}
+    alive.each { |c| rel[c] = [] }
+
+    seeds.each do |seed|
+      best = alive.map { |c| scores[c][seed] }.select { |s| s > 0 }.min
+
+      alive.each do |c|
+        score = scores[c][seed]
+        rel[c] << ((best && score > 0) ? best / score : 0.0)
+      end
+    end
+
+    rel
+  end
+
+  # drops configs that are worse than the leader by more than two standard errors
+  def drop_worse(alive, scores, seeds)
+    rel = relative_scores(alive, scores, seeds)
+    leader = alive.max_by { |c| mean(rel[c]) }
+
+    alive.select do |c|
+      next true if c == leader
+
+      diff = rel[leader].zip(rel[c]).map { |a, b| a - b }
+      mean(diff) <= 2.0 * stddev(diff) / Math.sqrt(diff.size)
+    end
+  end
+
+  def mutate(config)
+    config.map do |name, value|
+      default, min, max = PARAMS[name]
+      if rand < 0.5
+        value = default == 0 ? rand * max / 4.0 : value * Math.exp(rand(-0.7..0.7))
+        value = [[value, min].max, max].min
+      end
+      value = INT_PARAMS.include?(name) ? value.round : value.round(3)
+      [name, value]
+    end.to_h
+  end
+
+  def write_config(name, config)
+    path = File.join(DIR, "#{name}.txt")
+    File.open(path, 'w') do |file|
+      config.each { |key, value| file.puts("#{key} = #{value}") }
+    end
+    path
+  end
+
+  def write_table(table)
+    path = File.join(DIR, 'tuned.txt')
+
+    File.open(path, 'w') do |file|
+      file.puts('# generated by scripts/tune.rb, class <ship bucket> <ufo bucket> <stars / 700>')
+      table.sort.each do |klass, config|
+        file.puts("class #{klass}")
+        config.each { |key, value| file.puts("#{key} = #{value}") if value != @default[key] }
+      end
+    end
+
+    puts "wrote #{path}"
+  end
+
+  # [config path, seed] => [score, instance class], run on JOBS threads
+  def evaluate(jobs)
+    queue = Queue.new
+    jobs.each { |job| queue << job }
+    results = {}
+    mutex = Mutex.new
+
+    workers = Array.new(JOBS) do
+      Thread.new do
+        loop do
+          job = begin
+            queue.pop(true)
+          rescue ThreadError
+            break
+          end
+          result = run(*job)
+          mutex.synchronize { results[job] = result }
+        end
+      end
+    end
+    workers.each(&:join)
+
+    results
+  end
+
+  def run(path, seed)
+    out, err, _status = Open3.capture3({ 'STAR_PARAMS' => path }, format(RUNNER, seed))
+    text = out + err
+    score = text[/score\s*=\s*([\d.]+)/i, 1].to_f
+    klass = text[/instance = (-?\d+ -?\d+ -?\d+)/, 1]
+
+    [score, klass]
+  end
+
+  def mean(list)
+    list.empty? ? 0.0 : list.sum / list.size
+  end
+
+  def stddev(list)
+    return 0.0 if list.size < 2
+    m = mean(list)
+    Math.sqrt(list.map { |x| (x - m) ** 2 }.sum / (list.size - 1))
+  end
+end
+
+first = (ARGV[0] || 3001).to_i
+last = (ARGV[1] || 3400).to_i
+Tune.new((first..last).to_a)